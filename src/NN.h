@@ -1,431 +1,4083 @@
 #ifndef NN
 #define NN
 
-#include "hashmap/hashmap.h"
-#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <tgmath.h>
 
 //// GLOBALS ////
-uint64_t NN_VAR_ID = 0;
+#ifndef NN_REAL
+#define NN_REAL double // scalar type of values and gradients, e.g. -DNN_REAL=float
+#endif
+typedef NN_REAL nn_real;
+
+// last stamp handed out to a traversal, tape or gradient allocator. Shared by
+// all threads so stamps never collide, but only touched once per pass.
+atomic_uint_fast64_t NN_EPOCH = 0;
+// context bound to this thread (NULL: the thread's default context)
+_Thread_local struct GraphContext *NN_CONTEXT = NULL;
+
+#define NN_ARENA_CHUNK_SIZE ((size_t)1 << 16) // default bytes per arena chunk
+#define NN_ARENA_ALIGN 16                     // alignment of arena allocations
+
+#define NN_BUFFER_MIN 64                    // bytes of the smallest buffer size class
+#define NN_BUFFER_CLASSES (1 + 4 * (64 - 6)) // four size classes per power of two above NN_BUFFER_MIN
+#define NN_BUFFER_ALIGN 64                   // alignment of cached buffers, enough for any GemmVec
+
+#define NN_MAX_DIMS 8            // max rank of a tensor
+#define NN_TENSOR_MAX_CHILDREN 8 // max operands of a tensor op (inputs of a fused expression)
+#define NN_FUSE_BLOCK 256        // elements a fused expression is evaluated on at a time
+
+// GEMM register tile: MR rows of two SIMD vectors of the target. The MR x 2
+// accumulators plus a row of B fit the vector register file: 32 zmm with
+// AVX-512, 16 ymm with AVX, 16 xmm with SSE2/NEON.
+#if defined(__AVX512F__)
+#define NN_GEMM_VECTOR 64
+#define NN_GEMM_MR 8
+#elif defined(__AVX__)
+#define NN_GEMM_VECTOR 32
+#define NN_GEMM_MR 6
+#else
+#define NN_GEMM_VECTOR 16
+#define NN_GEMM_MR 6
+#endif
+// GEMM blocking: KC x NR panels of B stay in L1, MC x KC blocks of A in L2,
+// KC x NC panels of B in L3
+#define NN_GEMM_NR (2 * NN_GEMM_VECTOR / sizeof(nn_real))
+#define NN_GEMM_KC 256
+#define NN_GEMM_MC (20 * NN_GEMM_MR)
+#define NN_GEMM_NC 1024
+
+#define NN_PARALLEL_MIN_NODES 4096 // smaller graphs are swept on the calling thread
+
+#ifndef NN_LANES
+#define NN_LANES 4 // adjoint lanes of a batched reverse sweep
+#endif
+
+#ifndef NN_DUAL_LANES
+#define NN_DUAL_LANES 4 // tangent lanes carried by a Dual
+#endif
 
 //// TYPES /////
 
+// Where the memory of a Variable (and of its edge arrays) comes from
+typedef enum VarStorage
+{
+    NN_STORAGE_USER,  // owned by the caller, e.g. leaves set up with init_var
+    NN_STORAGE_HEAP,  // node, children and local_grads malloc'd by an op
+    NN_STORAGE_ARENA, // node, children and local_grads bumped from an Arena
+} VarStorage;
+
+// Scalar op codes
+typedef enum NNOp
+{
+    NN_OP_LEAF, // input value, no operands
+    NN_OP_ADD,
+    NN_OP_SUB,
+    NN_OP_MUL,
+    NN_OP_SIGMOID,
+    NN_OP_RELU,
+    NN_OP_POWER,
+    NN_OP_CHECKPOINT, // output of a checkpoint region, one operand per region input
+} NNOp;
+
 // A scalar value
 typedef struct Variable
 {
-    double val;                 // double value
+    nn_real val;                // value
     struct Variable **children; // array of pointers to child variables
-    double *local_grads;        // accompanying local grads
+    nn_real *local_grads;       // accompanying local grads
     int n_children;             // number of children
     bool can_grad;              // can we perform gradient updates on the value during backpropagation?
-    uint64_t id;                // unique id (used for hashing)
+    bool requires_grad;         // can_grad was set on a node below it (or on itself) when it was built
+    uint64_t id;                // unique id
+    VarStorage storage;         // who owns the node's memory
+    uint64_t tape_id;           // recording session of the tape that returned the value (0: not a tape value)
+    size_t tape_index;          // index of the value's entry on that tape
+    uint64_t context;           // id of the GraphContext whose ops built the node (0: none)
+    uint64_t mark;              // epoch of the last traversal in that context that reached the node
+    size_t slot;                // position in that traversal's topological order
+    NNOp op;                    // op that produced the value
+    nn_real param;              // op parameter (exponent of power)
+    _Atomic size_t refcount;    // references held by parent nodes and retain_variable
+    struct Checkpoint *region;  // how to rebuild the region of a checkpoint node (NULL otherwise)
 } Variable;
 
-// A "tensor"
+// Builds the output of a checkpoint region from its inputs with the scalar
+// ops. It must only use inputs (and constants it creates), arg is passed
+// through unchanged.
+typedef Variable *(*CheckpointFn)(Variable **inputs, size_t n_inputs, void *arg);
+
+// A region whose interior is dropped after forward and rebuilt in backward
+typedef struct Checkpoint
+{
+    CheckpointFn fn; // builds the region
+    void *arg;       // passed to fn
+    bool ready;      // the node's local grads were recomputed already
+} Checkpoint;
+
+// A dense tensor, and a node of the tensor autograd graph: a whole tensor op
+// is one node, with a backward function that pushes the gradient of its
+// output to all of its children at once
 typedef struct Tensor
 {
-    Variable **variables; // array of variables, indexing is determined by shape
-    size_t *shape;        // shape of tensor
-    size_t shape_size;    // length of shape array
-    int *strides;         // for indexing in each dim.
+    nn_real *data;                                   // elements, laid out by strides
+    nn_real *grad;                                   // gradient, same layout as data (NULL until backward needs it)
+    size_t size;                                     // number of elements
+    size_t shape[NN_MAX_DIMS];                       // shape of tensor
+    size_t shape_size;                               // number of dims
+    int strides[NN_MAX_DIMS];                        // elements to step in each dim, row-major when contiguous
+    bool owns_data;                                  // data is freed with the tensor
+    bool is_view;                                    // shares the data and grad storage of children[0]
+    ptrdiff_t offset;                                // view: start of data within children[0]'s data
+    struct Tensor *children[NN_TENSOR_MAX_CHILDREN]; // operands of the op that produced the tensor
+    int n_children;                                  // number of operands (0 for leaves)
+    void (*backward)(struct Tensor *);               // adds the gradient of the children given the tensor's grad
+    void *saved;                                     // op state kept for backward, freed with the tensor
+    NNOp op;                                         // element-wise op that produced the tensor (NN_OP_LEAF otherwise)
+    nn_real param;                                   // op parameter (exponent of power, ...)
+    bool requires_grad;                              // set on leaves to train, propagated to op results
+    size_t refcount;                                 // references held by parent tensors and retain_tensor
+    uint64_t mark;                                   // epoch of the last traversal that reached the tensor
 } Tensor;
 
+// NN_LANES adjoints of one node, one per output of a batched reverse sweep.
+// A GCC/Clang vector type, so the per-lane math compiles to SIMD.
+typedef nn_real Lanes __attribute__((vector_size(NN_LANES * sizeof(nn_real))));
+
+// How a reduction maps its input onto its output, kept for backward
+typedef struct Reduction
+{
+    size_t n_out;                   // output elements
+    size_t n_red;                   // input elements reduced into each output element
+    size_t kept_shape[NN_MAX_DIMS]; // sizes of the input dims that are kept
+    int kept_strides[NN_MAX_DIMS];  // their strides in the input
+    size_t n_kept;                  // number of kept dims
+    ptrdiff_t *red_offsets;         // offset of each reduced element from its output's base
+    ptrdiff_t *picked;              // max: offset in the input of each output's maximum
+    bool contiguous;                // red_offsets are 0, 1, 2, ...
+} Reduction;
+
+// Geometry of a 2-D convolution, kept for backward
+typedef struct Conv2dParams
+{
+    size_t stride;   // step between output positions, in input pixels
+    size_t padding;  // implicit zeros on every side of the input
+    size_t dilation; // step between kernel taps, in input pixels
+} Conv2dParams;
+
+// What softmax_cross_entropy keeps for backward, in one allocation
+typedef struct SoftmaxCrossEntropy
+{
+    size_t *targets; // class of each row
+    nn_real *lse;    // log-sum-exp of each row of the logits
+} SoftmaxCrossEntropy;
+
+// One SIMD vector of the target; a row of the GEMM register tile is two
+typedef nn_real GemmVec __attribute__((vector_size(NN_GEMM_VECTOR)));
+
+// Open-addressing map from nodes to indices, for per-pass state that must not
+// be written onto nodes other threads may be reading. Entries with any stamp
+// but the map's count as empty, so a new stamp clears it in O(1).
+typedef struct VarMap
+{
+    const Variable **keys;
+    size_t *vals;
+    uint64_t *stamps; // stamp each entry was written under
+    size_t cap;       // power of two (0: nothing allocated yet)
+    size_t n;         // entries under the current stamp
+    uint64_t stamp;
+} VarMap;
+
+// A node on the explicit DFS stack used by topo_sort
+typedef struct VisitFrame
+{
+    Variable *var;  // node being visited
+    int next_child; // index of the next child to descend into
+    size_t edge;    // index in edges of the node's first child
+} VisitFrame;
+
+// Gradient store and traversal state of backward passes. Everything a pass
+// computes lives here rather than on the nodes, except the mark and slot of
+// nodes built by the sorting thread's own context, so graphs that share
+// leaves (e.g. model weights) can be differentiated on several threads. The
+// sort resolves every edge to the slot of its child, so sweeps only index
+// dense arrays.
 typedef struct VariablesGradAllocator
 {
-    struct hashmap *dep_grad_map;
     Variable **independent_vars; // independent var whose gradient we are calculating
-    Variable **dependent_vars;   // independent var whose gradient we are calculating
+    Variable **dependent_vars;   // nodes with can_grad set that were reached
+    nn_real *grads;              // grads[i]: gradient accumulated for dependent_vars[i]
     size_t n_indep_vars;
     size_t n_dep_vars;
+    size_t indep_cap;    // capacity of independent_vars
+    size_t dep_cap;      // capacity of dependent_vars and grads
+    uint64_t tag;        // a new tag drops every gradient
+    VarMap grad_index;   // index of each dependent var, built once a second pass accumulates (stamped with tag)
+    Variable **order;    // topological order of the last pass
+    nn_real *adjoints;   // adjoints[slot] is the adjoint of order[slot] during a pass
+    size_t *first_edge;  // first_edge[slot]: where the children of order[slot] start in edges
+    size_t *grad_slot;   // grad_slot[slot]: index of order[slot] in dependent_vars (SIZE_MAX: none)
+    size_t *edges;       // slot of each child of the sorted nodes (SIZE_MAX: not sorted)
+    VisitFrame *stack;   // DFS stack for topo_sort
+    size_t order_cap;    // capacity of order, adjoints, first_edge and grad_slot
+    size_t edges_cap;    // capacity of edges
+    size_t stack_cap;    // capacity of stack
+    uint64_t epoch;      // mark of the nodes reached by the last sort_graph
+    uint64_t context;    // id of the context that ran it: its nodes keep mark and slot themselves
+    uint64_t swept;      // epoch of the sort whose gradients grad_slot indexes (0: none)
+    size_t n_order;      // nodes in order
+    size_t n_edges;      // entries used in edges
+    VarMap visited;      // slot of every other node it reached, stamped with epoch
+    bool indexed;        // visited also holds the nodes the sort owns (after a lookup missed)
+    bool keep_constants; // also sort subgraphs that need no gradient (program_capture)
+    bool graph_regions;  // the caller rebuilds checkpoint regions itself, skip their local grads (get_gradients_graph)
+    Lanes *lanes;        // lanes[slot]: adjoints of order[slot] in the last batched sweep
+    size_t lanes_cap;    // capacity of lanes
 } VariablesGradAllocator;
 
-// Initialize variables
-void init_var(Variable *var, double value, bool grad)
+// A value with NN_DUAL_LANES tangents for forward-mode AD. Lane k carries the
+// derivative of val along the k-th input direction, so k directional
+// derivatives come out of a single forward sweep.
+typedef struct Dual
 {
-    var->val = value;
-    var->children = NULL;
-    var->local_grads = NULL;
-    var->n_children = 0;
-    var->can_grad = grad;
-    var->id = NN_VAR_ID;
-    NN_VAR_ID++;
+    nn_real val;                // value
+    nn_real tan[NN_DUAL_LANES]; // tangent lanes
+} Dual;
+
+// One instruction of a captured Program
+typedef struct ProgramInstr
+{
+    NNOp op;          // op computing the slot
+    uint32_t args[2]; // slots of the operands
+    nn_real param;    // op parameter (exponent of power)
+} ProgramInstr;
+
+// A node of a lazy element-wise tensor expression. Nothing is computed until
+// tensor_eval fuses the whole tree into one tensor op.
+typedef struct TensorExpr
+{
+    NNOp op;                    // NN_OP_LEAF for an input tensor
+    struct TensorExpr *args[2]; // operands (args[1] is NULL for unary ops)
+    Tensor *tensor;             // input tensor of a leaf
+    nn_real param;              // op parameter (exponent of power)
+    size_t shape[NN_MAX_DIMS];  // broadcast shape of the value
+    size_t shape_size;          // number of dims
+    uint64_t mark;              // epoch of the last tensor_eval that reached the node
+    uint32_t slot;              // its instruction in that evaluation
+} TensorExpr;
+
+// A fused expression in postfix order: a load (NN_OP_LEAF, args[0] is the
+// index of the input among the node's children) or an element-wise op per
+// instruction, the last one computing the result
+typedef struct FusedKernel
+{
+    size_t n_instrs;
+    ProgramInstr *instrs;
+} FusedKernel;
+
+// A forward pass captured into an immutable, flat instruction list, one
+// instruction per node in topological order, over preallocated value and
+// gradient buffers. Replaying it only rebinds the inputs; nothing is
+// allocated or linked.
+typedef struct Program
+{
+    ProgramInstr *instrs; // instrs[slot] computes vals[slot]
+    size_t n_instrs;
+    nn_real *vals;        // value of every slot
+    nn_real *local_grads; // 2 local grads per slot
+    nn_real *grads;       // adjoint of every slot, filled in by program_backward
+    uint32_t *inputs;     // slots of the rebindable inputs (UINT32_MAX: not used by the outputs)
+    size_t n_inputs;
+    uint32_t *outputs;    // slots of the outputs
+    size_t n_outputs;
+} Program;
+
+// One block of memory in an Arena
+typedef struct ArenaChunk
+{
+    struct ArenaChunk *next; // next chunk in the chain
+    unsigned char *data;     // start of the usable bytes (right after the header)
+    size_t size;             // usable bytes in data
+    size_t used;             // bytes handed out so far
+} ArenaChunk;
+
+// Bump allocator for graph nodes. Allocations are carved out of a chain of
+// chunks, and everything is reclaimed at once with arena_reset, which keeps
+// the chunks around for the next training step. References that nodes in the
+// arena hold on nodes outside of it are owned by the arena and dropped there.
+typedef struct Arena
+{
+    ArenaChunk *head;    // first chunk in the chain
+    ArenaChunk *current; // chunk allocations are bumped from
+    size_t chunk_size;   // minimum size of a new chunk
+    Variable **held;     // nodes outside the arena referenced from inside it, once per reference
+    size_t n_held;
+    size_t held_cap;     // capacity of held
+} Arena;
+
+// Caching allocator for tensor buffers. Freed buffers are kept on a free list
+// per size class and handed out again, so a training step that allocates the
+// same sizes every iteration stops reaching malloc. Sizes round up to one of
+// four classes per power of two, wasting at most a quarter of a buffer.
+typedef struct BufferCache
+{
+    void *free_lists[NN_BUFFER_CLASSES]; // cached buffers of each class, linked through their first word
+    size_t hits;                         // allocations served from a free list
+    size_t misses;                       // allocations that went to the heap
+    size_t bytes_cached;                 // bytes held on the free lists
+} BufferCache;
+
+// One op on a Tape. Operands refer to earlier entries by index.
+typedef struct TapeEntry
+{
+    NNOp op;                // op that produced the value
+    uint32_t args[2];       // tape indices of the operands
+    nn_real val;            // value computed by the op
+    nn_real local_grads[2]; // d val / d operand
+} TapeEntry;
+
+// Wengert list: in tape mode every op appends one entry to a contiguous
+// array instead of linking a node into the graph, so backward is a single
+// reverse sweep over memory. The Variables ops hand back are bumped from the
+// tape's own arena, so recording does not touch the heap.
+typedef struct Tape
+{
+    TapeEntry *entries; // entries in execution order
+    nn_real *grads;     // adjoint of each entry, filled in by tape_backward
+    size_t n_entries;   // number of recorded entries
+    size_t cap;         // capacity of entries and grads
+    uint64_t id;        // recording session, identifies values recorded on this tape
+    Arena values;       // Variables returned by recorded ops
+    VarMap leaves;      // entry of each leaf recorded in the session, stamped with id
+} Tape;
+
+// Persistent worker threads. thread_pool_run hands one job to every worker
+// (the calling thread included) and waits for all of them to return.
+typedef struct ThreadPool
+{
+    pthread_t *threads;                    // worker threads besides the caller
+    size_t n_threads;                      // number of threads
+    pthread_mutex_t lock;                  // guards everything below
+    pthread_cond_t wake;                   // a job was posted, or the pool is stopping
+    pthread_cond_t done;                   // the last worker finished the job
+    void (*job)(void *arg, size_t worker); // job of the current generation
+    void *job_arg;
+    uint64_t generation;                   // bumped for every job
+    size_t n_running;                      // threads still inside the current job
+    bool stop;                             // set when the pool is freed
+} ThreadPool;
+
+// Per-worker deque of ready node slots: the owner pushes and pops at the
+// tail, idle workers steal from the head
+typedef struct WorkDeque
+{
+    size_t *items;
+    size_t head;          // next item to steal
+    size_t tail;          // one past the owner's last item
+    size_t cap;           // capacity of items
+    pthread_mutex_t lock; // guards items, head and tail
+} WorkDeque;
+
+// Shared state of a parallel backward sweep
+typedef struct ParallelSweep
+{
+    Variable **order;          // nodes in topological order
+    _Atomic nn_real *adjoints; // adjoint per slot
+    atomic_size_t *pending;    // parent edges of each slot not swept yet
+    atomic_size_t remaining;   // nodes not swept yet
+    WorkDeque *deques;         // one deque per worker
+    size_t n_workers;
+    const size_t *first_edge;  // edges of the sort, as in VariablesGradAllocator
+    const size_t *edges;
+} ParallelSweep;
+
+// Everything ops need to build and differentiate a graph: the id counter,
+// the allocator nodes come from, the bound tape and a gradient store. Each
+// thread binds its own context, so graphs can be built and differentiated on
+// every core without locks. Graphs on different threads may share nodes,
+// e.g. the leaves holding model weights: a pass only writes to nodes its own
+// context built, keeps its state for every other node in its allocator, and
+// operand reference counts are atomic. Pin shared leaves with retain_variable
+// so that no thread frees them along with its graph.
+typedef struct GraphContext
+{
+    uint64_t id;                       // stamped on the nodes built by the context's ops
+    uint64_t next_id;                  // id given to the next variable
+    Arena *arena;                      // arena ops allocate from (NULL: heap)
+    Tape *tape;                        // tape ops record onto (NULL: build graph nodes)
+    Arena node_arena;                  // arena owned by the context
+    VariablesGradAllocator grad_alloc; // gradient store owned by the context
+    BufferCache buffers;               // tensor buffers freed in the context
+} GraphContext;
+
+_Thread_local GraphContext NN_DEFAULT_CONTEXT;    // used by threads that bind no context
+_Thread_local bool NN_DEFAULT_CONTEXT_READY = false;
+
+GraphContext *graph_context(void);
+
+// Hand out a new stamp, unique across threads
+uint64_t next_epoch(void)
+{
+    return atomic_fetch_add(&NN_EPOCH, 1) + 1;
 }
 
-void free_variable(Variable *var)
+//// ARENA /////
+
+void release_variable(Variable *var);
+
+// Initialize an empty arena, chunk_size of 0 uses NN_ARENA_CHUNK_SIZE
+void arena_init(Arena *arena, size_t chunk_size)
 {
-    if (var->local_grads != NULL)
-    {
-        free(var->local_grads);
-        var->local_grads = NULL;
-    }
-    if (var->children != NULL)
+    arena->head = NULL;
+    arena->current = NULL;
+    arena->chunk_size = chunk_size == 0 ? NN_ARENA_CHUNK_SIZE : chunk_size;
+    arena->held = NULL;
+    arena->n_held = 0;
+    arena->held_cap = 0;
+}
+
+// Record a reference taken by a node in the arena on var, which lives outside
+// of it. It is dropped when the arena is reset or freed.
+void arena_hold(Arena *arena, Variable *var)
+{
+    if (arena->n_held == arena->held_cap)
     {
-        free(var->children);
-        var->children = NULL;
+        arena->held_cap = arena->held_cap == 0 ? 64 : arena->held_cap * 2;
+        arena->held = (Variable **)realloc(arena->held, arena->held_cap * sizeof(Variable *));
     }
-    var = NULL;
+    arena->held[arena->n_held++] = var;
 }
 
-// free a variable and all of its children
-void free_from_variable(Variable *var)
+// Drop the references recorded with arena_hold
+void arena_release_held(Arena *arena)
 {
-    if (var == NULL)
+    for (size_t idx = 0; idx < arena->n_held; idx++)
     {
-        return;
+        release_variable(arena->held[idx]);
     }
+    arena->n_held = 0;
+}
+
+// Bump-allocate size bytes. Moves on to the next chunk (reused from before the
+// last reset, or a new one) when the current one is full.
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = (size + NN_ARENA_ALIGN - 1) & ~(size_t)(NN_ARENA_ALIGN - 1);
 
-    for (int i = 0; i < var->n_children; i++)
+    ArenaChunk *chunk = arena->current;
+    while (chunk == NULL || chunk->used + size > chunk->size)
     {
-        free_from_variable(var->children[i]);
+        ArenaChunk *next = chunk == NULL ? arena->head : chunk->next;
+        if (next == NULL)
+        {
+            size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+            next = (ArenaChunk *)malloc(sizeof(ArenaChunk) + chunk_size);
+            next->next = NULL;
+            next->data = (unsigned char *)(next + 1);
+            next->size = chunk_size;
+            if (chunk == NULL)
+            {
+                arena->head = next;
+            }
+            else
+            {
+                chunk->next = next;
+            }
+        }
+        // chunks past the current one are free since the last reset
+        next->used = 0;
+        chunk = next;
     }
 
-    free_variable(var);
+    arena->current = chunk;
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
 
-    return;
+// Reclaim everything allocated from the arena in O(1), keeping its chunks, and
+// drop the references its nodes held on nodes outside of it
+void arena_reset(Arena *arena)
+{
+    arena_release_held(arena);
+    arena->current = arena->head;
+    if (arena->head != NULL)
+    {
+        arena->head->used = 0;
+    }
 }
 
-// TODO: any mem leaks?
-void free_graph(Variable **outs, size_t n_vars)
+// Give all chunks back to the heap
+void arena_free(Arena *arena)
 {
-    for (int i = 0; i < n_vars; i++)
+    arena_release_held(arena);
+    free(arena->held);
+    arena->held = NULL;
+    arena->held_cap = 0;
+    ArenaChunk *chunk = arena->head;
+    while (chunk != NULL)
     {
-        free_from_variable(outs[i]);
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
+    arena->head = NULL;
+    arena->current = NULL;
 }
 
-void print_variable(const Variable *var)
+// Make ops allocate their nodes from arena (NULL: from the heap). Returns the
+// previously bound arena.
+Arena *bind_arena(Arena *arena)
 {
-    printf("val: %lf, n_children: %d, children: %p, local_grads: %p\n", var->val,
-           var->n_children, (void *)var->children, (void *)var->local_grads);
+    GraphContext *ctx = graph_context();
+    Arena *prev = ctx->arena;
+    ctx->arena = arena;
+    return prev;
 }
 
-// Hash function for Variable struct
-uint64_t var_hash(const void *item, uint64_t seed0, uint64_t seed1)
+// Initialize variables
+void init_var(Variable *var, nn_real value, bool grad)
 {
-    const Variable *variable = (const Variable *)item;
-    return hashmap_sip(&(variable->id), sizeof(variable->id), seed0, seed1);
-    // return variable->id; // TODO: Use the id field as the hash???
+    var->val = value;
+    var->children = NULL;
+    var->local_grads = NULL;
+    var->n_children = 0;
+    var->can_grad = grad;
+    var->requires_grad = grad;
+    var->id = graph_context()->next_id++;
+    var->storage = NN_STORAGE_USER;
+    var->tape_id = 0;
+    var->tape_index = 0;
+    var->context = 0;
+    var->mark = 0;
+    var->slot = 0;
+    var->op = NN_OP_LEAF;
+    var->param = 0;
+    atomic_init(&var->refcount, 0);
+    var->region = NULL;
 }
 
-// Key comparison function for Variable struct
-int var_compare(const void *a, const void *b, void *udata)
+// Allocate the result of an op with room for n_children children and local
+// grads. Nodes come from the context's arena (node and edge arrays in a
+// single bump) if it has one, and from the heap otherwise.
+Variable *new_op_var(nn_real value, int n_children)
 {
-    const Variable *var_a = (const Variable *)a;
-    const Variable *var_b = (const Variable *)b;
-    if (var_a->id < var_b->id)
+    GraphContext *ctx = graph_context();
+    Arena *arena = ctx->arena;
+    Variable *var;
+    if (arena != NULL)
     {
-        return -1;
-    }
-    else if (var_a->id > var_b->id)
-    {
-        return 1;
+        var = (Variable *)arena_alloc(arena, sizeof(Variable) + n_children * (sizeof(Variable *) + sizeof(nn_real)));
+        init_var(var, value, false);
+        var->storage = NN_STORAGE_ARENA;
+        if (n_children > 0)
+        {
+            var->children = (Variable **)(var + 1);
+            var->local_grads = (nn_real *)(var->children + n_children);
+        }
     }
     else
     {
-        return 0;
+        var = (Variable *)malloc(sizeof(Variable));
+        init_var(var, value, false);
+        var->storage = NN_STORAGE_HEAP;
+        if (n_children > 0)
+        {
+            var->children = (Variable **)malloc(n_children * sizeof(Variable *));
+            var->local_grads = (nn_real *)malloc(n_children * sizeof(nn_real));
+        }
     }
+    var->n_children = n_children;
+    var->context = ctx->id;
+    return var;
 }
 
-bool var_iter(const void *item, void *var_data)
-{
-    const Variable *var = item;
-    print_variable(var);
-    return true;
-}
+//// BUFFER CACHE /////
 
-// Initialize gradient buffer
-void init_grad_alloc(VariablesGradAllocator *var_grad_allocator)
+// Size class of a buffer of bytes bytes
+size_t buffer_class(size_t bytes)
 {
-    VariablesGradAllocator temp = {0};
-    *(var_grad_allocator) = temp;
-    var_grad_allocator->independent_vars = (Variable **)malloc(sizeof(Variable *));
-    var_grad_allocator->dependent_vars = (Variable **)malloc(sizeof(Variable *));
-    struct hashmap *map = hashmap_new(sizeof(Variable *), 0, 0, 0, var_hash,
-                                      var_compare, NULL, NULL);
-    if (map == NULL)
+    if (bytes <= NN_BUFFER_MIN)
     {
-        // TODO LOL, is his bad practice?
-        printf("failed to initialize map!");
+        return 0;
     }
-    var_grad_allocator->dep_grad_map = map;
+    size_t b = bytes - 1;
+    int p = 63 - __builtin_clzll(b); // bytes lies in (2^p, 2^(p+1)]
+    return 1 + (size_t)(p - 6) * 4 + ((b >> (p - 2)) & 3);
 }
 
-// Free gradient buffer
-void free_grad_alloc(VariablesGradAllocator *var_grad_allocator, size_t size)
+// Bytes of every buffer in size class cls
+size_t buffer_class_size(size_t cls)
 {
-    for (size_t idx = 0; idx < var_grad_allocator->n_indep_vars; idx++)
+    if (cls == 0)
     {
-        free_from_variable(var_grad_allocator->independent_vars[idx]);
+        return NN_BUFFER_MIN;
     }
+    size_t p = 6 + (cls - 1) / 4;
+    return (4 + (cls - 1) % 4 + 1) << (p - 2);
+}
 
-    // TODO: does this not already free all all of the dependent_vars?
-    hashmap_free(var_grad_allocator->dep_grad_map);
+void buffer_cache_init(BufferCache *cache)
+{
+    memset(cache, 0, sizeof(BufferCache));
+}
 
-    for (size_t idx = 0; idx < var_grad_allocator->n_dep_vars; idx++)
+// A zeroed buffer of at least bytes bytes, reused from the free list of its
+// size class when there is one
+void *buffer_alloc(BufferCache *cache, size_t bytes)
+{
+    size_t cls = buffer_class(bytes);
+    void *buffer = cache->free_lists[cls];
+    if (buffer == NULL)
     {
-        free_from_variable(var_grad_allocator->dependent_vars[idx]);
+        cache->misses++;
+        size_t size = (buffer_class_size(cls) + NN_BUFFER_ALIGN - 1) & ~(size_t)(NN_BUFFER_ALIGN - 1);
+        buffer = aligned_alloc(NN_BUFFER_ALIGN, size);
+        memset(buffer, 0, size);
+        return buffer;
     }
+    cache->free_lists[cls] = *(void **)buffer;
+    cache->bytes_cached -= buffer_class_size(cls);
+    cache->hits++;
+    memset(buffer, 0, bytes);
+    return buffer;
 }
 
-// index a tensor
-int tensor_index(Tensor *tensor, int *indices)
+// Return a buffer of bytes bytes from buffer_alloc (of any cache) to cache
+void buffer_free(BufferCache *cache, void *buffer, size_t bytes)
 {
-    int index = 0;
-    for (int i = 0; i < tensor->shape_size; ++i)
+    if (buffer == NULL)
     {
-        index += tensor->strides[i] * indices[i];
+        return;
     }
-    return index;
+    size_t cls = buffer_class(bytes);
+    *(void **)buffer = cache->free_lists[cls];
+    cache->free_lists[cls] = buffer;
+    cache->bytes_cached += buffer_class_size(cls);
 }
 
-// initializing an empty tensor with shape
-Tensor *init_tensor(size_t shape_size, size_t *shape)
+// Give every cached buffer back to the heap
+void buffer_cache_trim(BufferCache *cache)
 {
-    Tensor *tensor = malloc(sizeof tensor);
-    tensor->shape_size = shape_size;
-    tensor->shape = malloc(shape_size * sizeof(size_t));
-    tensor->strides = malloc(shape_size * sizeof(int));
-
-    int total_size = 1;
-    for (int i = 0; i < shape_size; ++i)
+    for (size_t cls = 0; cls < NN_BUFFER_CLASSES; cls++)
     {
-        tensor->shape[i] = shape[i];
-        tensor->strides[i] = total_size;
-        total_size *= shape[i];
+        while (cache->free_lists[cls] != NULL)
+        {
+            void *next = *(void **)cache->free_lists[cls];
+            free(cache->free_lists[cls]);
+            cache->free_lists[cls] = next;
+        }
     }
-
-    tensor->variables = malloc(total_size * sizeof(Variable *));
-    return tensor;
+    cache->bytes_cached = 0;
 }
 
-//// SCALAR OPS /////
+//// VAR MAP /////
 
-// Builds the compute graph for addition between scalar variables
-Variable *add(Variable *x, Variable *y)
+size_t var_map_hash(const Variable *var)
 {
-    // Allocate memory for children and local gradients
-    Variable **children = malloc((sizeof *children) * 2);
-    double *local_grads = malloc((sizeof *local_grads) * 2);
-
-    // Set up children and local gradients
-    children[0] = x;
-    local_grads[0] = 1;
-    children[1] = y;
-    local_grads[1] = 1;
-
-    // Create a new Variable with the computed value and connections
-    Variable *newValue = malloc(sizeof *newValue);
-    init_var(newValue, x->val + y->val, false);
-    newValue->children = children;
-    newValue->local_grads = local_grads;
-    newValue->n_children = 2;
-
-    return newValue;
+    uint64_t h = (uint64_t)(uintptr_t)var * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h ^ (h >> 29));
 }
 
-// Builds the compute graph for subtraction between scalar variables
-Variable *sub(Variable *x, Variable *y)
+// Clear map by moving it to a new stamp
+void var_map_reset(VarMap *map, uint64_t stamp)
 {
-    // Allocate memory for children and local gradients
-    Variable **children = malloc((sizeof *children) * 2);
-    double *local_grads = malloc((sizeof *local_grads) * 2);
+    map->stamp = stamp;
+    map->n = 0;
+}
 
-    // Set up children and local gradients
-    children[0] = x;
-    local_grads[0] = 1;
-    children[1] = y;
-    local_grads[1] = 1;
+// Index stored for var, NULL if var has no entry under the current stamp
+size_t *var_map_find(const VarMap *map, const Variable *var)
+{
+    if (map->cap == 0)
+    {
+        return NULL;
+    }
+    for (size_t i = var_map_hash(var) & (map->cap - 1);; i = (i + 1) & (map->cap - 1))
+    {
+        if (map->stamps[i] != map->stamp)
+        {
+            return NULL;
+        }
+        if (map->keys[i] == var)
+        {
+            return &map->vals[i];
+        }
+    }
+}
 
-    // Create a new Variable with the computed value and connections
-    Variable *newValue = malloc(sizeof *newValue);
-    init_var(newValue, x->val - y->val, false);
-    newValue->children = children;
-    newValue->local_grads = local_grads;
-    newValue->n_children = 2;
+size_t *var_map_insert(VarMap *map, const Variable *var, bool *inserted);
 
-    return newValue;
+// Double the capacity (at least 64), keeping the entries of the current stamp
+void var_map_grow(VarMap *map)
+{
+    VarMap old = *map;
+    map->cap = old.cap == 0 ? 64 : 2 * old.cap;
+    map->keys = (const Variable **)malloc(map->cap * sizeof(Variable *));
+    map->vals = (size_t *)malloc(map->cap * sizeof(size_t));
+    map->stamps = (uint64_t *)calloc(map->cap, sizeof(uint64_t));
+    map->n = 0;
+    for (size_t i = 0; i < old.cap; i++)
+    {
+        if (old.stamps[i] == old.stamp)
+        {
+            bool inserted;
+            *var_map_insert(map, old.keys[i], &inserted) = old.vals[i];
+        }
+    }
+    free(old.keys);
+    free(old.vals);
+    free(old.stamps);
 }
 
-// Builds the compute graph for multiplication between scalar variables
-Variable *mul(Variable *x, Variable *y)
+// Entry of var, added with value 0 if it has none under the current stamp
+// (inserted tells which)
+size_t *var_map_insert(VarMap *map, const Variable *var, bool *inserted)
 {
-    // Allocate memory for children and local gradients
-    Variable **children = malloc((sizeof *children) * 2);
-    double *local_grads = malloc((sizeof *local_grads) * 2);
+    if (2 * (map->n + 1) > map->cap)
+    {
+        var_map_grow(map);
+    }
+    for (size_t i = var_map_hash(var) & (map->cap - 1);; i = (i + 1) & (map->cap - 1))
+    {
+        if (map->stamps[i] != map->stamp)
+        {
+            map->keys[i] = var;
+            map->vals[i] = 0;
+            map->stamps[i] = map->stamp;
+            map->n++;
+            *inserted = true;
+            return &map->vals[i];
+        }
+        if (map->keys[i] == var)
+        {
+            *inserted = false;
+            return &map->vals[i];
+        }
+    }
+}
 
-    // Set up children and local gradients
-    children[0] = x;
-    local_grads[0] = y->val;
-    children[1] = y;
-    local_grads[1] = x->val;
+void var_map_free(VarMap *map)
+{
+    free(map->keys);
+    free(map->vals);
+    free(map->stamps);
+    memset(map, 0, sizeof(VarMap));
+}
 
-    // Create a new Variable with the computed value and connections
-    Variable *newValue = malloc(sizeof *newValue);
-    init_var(newValue, x->val * y->val, false);
-    newValue->children = children;
-    newValue->local_grads = local_grads;
-    newValue->n_children = 2;
+//// TAPE /////
 
-    return newValue;
+// Initialize an empty tape
+void tape_init(Tape *tape)
+{
+    tape->entries = NULL;
+    tape->grads = NULL;
+    tape->n_entries = 0;
+    tape->cap = 0;
+    tape->id = next_epoch();
+    arena_init(&tape->values, 0);
+    memset(&tape->leaves, 0, sizeof(VarMap));
+    var_map_reset(&tape->leaves, tape->id);
 }
 
-// Builds the compute graph for the sigmoid function on a scalar variable
-Variable *sigmoid(Variable *x)
+// Drop all entries, keeping the buffers. The Variables returned by ops
+// recorded before the reset are reclaimed; caller-owned leaves are recorded
+// again as new leaves when they are used again.
+void tape_reset(Tape *tape)
 {
-    // Allocate memory for children and local gradients
-    Variable **children = malloc((sizeof *children) * 1);
-    double *local_grads = malloc((sizeof *local_grads) * 1);
-
-    // Set up children and local gradients
-    children[0] = x;
-    double sigmoid_val = 1 / (1 + exp(-(x->val)));
-    local_grads[0] = sigmoid_val * (1 - sigmoid_val);
-
-    // Create a new Variable with the computed value and connections
-    Variable *newValue = malloc(sizeof *newValue);
-    init_var(newValue, sigmoid_val, false);
-    newValue->children = children;
-    newValue->local_grads = local_grads;
-    newValue->n_children = 1;
+    tape->n_entries = 0;
+    tape->id = next_epoch();
+    arena_reset(&tape->values);
+    var_map_reset(&tape->leaves, tape->id);
+}
 
-    return newValue;
+// Free the tape's buffers, along with every Variable recorded on it
+void tape_free(Tape *tape)
+{
+    free(tape->entries);
+    free(tape->grads);
+    tape->entries = NULL;
+    tape->grads = NULL;
+    tape->n_entries = 0;
+    tape->cap = 0;
+    arena_free(&tape->values);
+    var_map_free(&tape->leaves);
 }
 
-// Builds the compute graph for the ReLU function on a scalar variable
-Variable *relu(Variable *x)
+// Make ops record onto tape (NULL: build graph nodes). Returns the previously
+// bound tape.
+Tape *bind_tape(Tape *tape)
 {
-    // Allocate memory for children and local gradients
-    Variable **children = malloc((sizeof *children) * 1);
-    double *local_grads = malloc((sizeof *local_grads) * 1);
+    GraphContext *ctx = graph_context();
+    Tape *prev = ctx->tape;
+    ctx->tape = tape;
+    return prev;
+}
 
-    // Set up children and local gradients
-    children[0] = x;
-    local_grads[0] = x->val < 0 ? 0 : 1;
+// Number of operands an op reads
+int op_arity(NNOp op)
+{
+    switch (op)
+    {
+    case NN_OP_LEAF:
+        return 0;
+    case NN_OP_ADD:
+    case NN_OP_SUB:
+    case NN_OP_MUL:
+        return 2;
+    default:
+        return 1;
+    }
+}
 
-    // Create a new Variable with the computed value and connections
-    Variable *newValue = malloc(sizeof *newValue);
-    init_var(newValue, (x->val > 0) ? x->val : 0, false);
-    newValue->children = children;
-    newValue->local_grads = local_grads;
-    newValue->n_children = 1;
+// Append an entry, returns its index
+uint32_t tape_push(Tape *tape, NNOp op, uint32_t arg_0, uint32_t arg_1,
+                   nn_real value, nn_real grad_0, nn_real grad_1)
+{
+    if (tape->n_entries == tape->cap)
+    {
+        tape->cap = tape->cap == 0 ? 256 : tape->cap * 2;
+        tape->entries = (TapeEntry *)realloc(tape->entries, tape->cap * sizeof(TapeEntry));
+        tape->grads = (nn_real *)realloc(tape->grads, tape->cap * sizeof(nn_real));
+    }
 
-    return newValue;
+    TapeEntry *entry = &tape->entries[tape->n_entries];
+    entry->op = op;
+    entry->args[0] = arg_0;
+    entry->args[1] = arg_1;
+    entry->val = value;
+    entry->local_grads[0] = grad_0;
+    entry->local_grads[1] = grad_1;
+    return (uint32_t)tape->n_entries++;
 }
 
-Variable *power(Variable *x, double n)
+// Tape index of var, recording it as a leaf if it is not on the tape yet.
+// Leaves are looked up in the tape rather than marked, so several threads can
+// record over the same leaves.
+uint32_t tape_operand(Tape *tape, Variable *var)
 {
-    // Allocate memory for children and local gradients
-    Variable **children = malloc((sizeof *children) * 1);
-    double *local_grads = malloc((sizeof *local_grads) * 1);
+    if (var->tape_id == tape->id)
+    {
+        return (uint32_t)var->tape_index;
+    }
+    bool inserted;
+    size_t *index = var_map_insert(&tape->leaves, var, &inserted);
+    if (inserted)
+    {
+        *index = tape_push(tape, NN_OP_LEAF, 0, 0, var->val, 0, 0);
+    }
+    return (uint32_t)*index;
+}
 
-    // Set up children and local gradients
-    children[0] = x;
-    local_grads[0] = n * pow(x->val, n - 1);
+// Tape index of var, false if it was not recorded in the current session
+bool tape_entry(const Tape *tape, const Variable *var, size_t *index)
+{
+    if (var->tape_id == tape->id)
+    {
+        *index = var->tape_index;
+        return true;
+    }
+    const size_t *leaf = var_map_find(&tape->leaves, var);
+    if (leaf != NULL)
+    {
+        *index = *leaf;
+    }
+    return leaf != NULL;
+}
 
-    // Create a new Variable with the computed value and connections
-    Variable *newValue = malloc(sizeof *newValue);
-    init_var(newValue, pow(x->val, n), false);
-    newValue->children = children;
-    newValue->local_grads = local_grads;
-    newValue->n_children = 1;
+// Record an op on x (and y, NULL for unary ops) onto tape. The returned
+// Variable only carries the value and its tape index, it has no children.
+// It belongs to the tape and lives until tape_reset or tape_free; callers
+// never free it.
+Variable *tape_record(Tape *tape, NNOp op, Variable *x, Variable *y,
+                      nn_real value, nn_real grad_x, nn_real grad_y)
+{
+    uint32_t arg_0 = tape_operand(tape, x);
+    uint32_t arg_1 = y == NULL ? 0 : tape_operand(tape, y);
 
-    return newValue;
+    Variable *var = (Variable *)arena_alloc(&tape->values, sizeof(Variable));
+    init_var(var, value, false);
+    var->storage = NN_STORAGE_ARENA;
+    var->tape_id = tape->id;
+    var->tape_index = tape_push(tape, op, arg_0, arg_1, value, grad_x, grad_y);
+    return var;
 }
 
-// Helper function for get_gradients. Computes grads of all children of a
-// Variable
-void compute_grads(VariablesGradAllocator *grad_alloc,
-                   Variable *independent_var, double path_value)
+// Reverse sweep over the tape: fills tape->grads with sum_i seeds[i] * d
+// roots[i] / d entry (seeds NULL means 1 for every root)
+void tape_backward(Tape *tape, Variable **roots, const nn_real *seeds, size_t n_roots)
 {
-    // TODO: Unnecessary?
-    if (independent_var == NULL || grad_alloc == NULL || independent_var->children == NULL)
+    if (tape == NULL || roots == NULL)
     {
         return;
     }
 
-    for (int child_idx = 0; child_idx < independent_var->n_children;
-         child_idx++)
+    for (size_t idx = 0; idx < tape->n_entries; idx++)
     {
-        Variable *dependent_var = independent_var->children[child_idx];
-        double path_to_child_val =
-            path_value * independent_var->local_grads[child_idx];
-
-        uint64_t dep_hash = var_hash(dependent_var, 0, 0);
-        Variable v = {0};
-        Variable *g_var = (Variable *)hashmap_get_with_hash(grad_alloc->dep_grad_map, &v, dep_hash);
+        tape->grads[idx] = 0;
+    }
 
-        if (g_var == NULL)
+    // the sweep starts at the last root on the tape
+    size_t end = 0;
+    for (size_t root_idx = 0; root_idx < n_roots; root_idx++)
+    {
+        size_t index;
+        if (roots[root_idx] == NULL || !tape_entry(tape, roots[root_idx], &index))
         {
-            if (!dependent_var->can_grad)
-            {
-                break;
-            }
-
-            Variable *new_var = malloc(sizeof *new_var);
-            init_var(new_var, path_to_child_val, false);
-            const void *set = hashmap_set_with_hash(grad_alloc->dep_grad_map, new_var, dep_hash);
-            if (set == NULL)
-            {
-                size_t count = hashmap_count(grad_alloc->dep_grad_map);
-#ifdef DEBUG
-                printf("successfully inserted new grad at hash: %llu\n", dep_hash);
-                printf("# items in hash: %lu\n", count);
-#endif
-                grad_alloc->dependent_vars = (Variable **)realloc(grad_alloc->dependent_vars, count * sizeof(Variable *));
-                grad_alloc->dependent_vars[count - 1] = dependent_var;
-                grad_alloc->n_dep_vars++;
-            }
-#ifdef DEBUG
-            else
-            {
-
-                printf("insert failed at hash: %llu\n", dep_hash);
-            }
-#endif
+            continue;
         }
-        else
+        tape->grads[index] += seeds == NULL ? 1 : seeds[root_idx];
+        if (index + 1 > end)
         {
-#ifdef DEBUG
+            end = index + 1;
+        }
+    }
 
-            printf("val: %f ", path_to_child_val);
-            printf("\nis already occupying hash: %llu\n", dep_hash);
-#endif
-            g_var->val += path_to_child_val;
+    for (size_t idx = end; idx-- > 0;)
+    {
+        const TapeEntry *entry = &tape->entries[idx];
+        nn_real adjoint = tape->grads[idx];
+        for (int arg = 0; arg < op_arity(entry->op); arg++)
+        {
+            tape->grads[entry->args[arg]] += adjoint * entry->local_grads[arg];
         }
+    }
+}
 
-        compute_grads(grad_alloc, dependent_var, path_to_child_val);
+// Gradient from the last tape_backward w.r.t. var (0 if var is not on tape)
+nn_real tape_gradient(Tape *tape, Variable *var)
+{
+    size_t index;
+    if (!tape_entry(tape, var, &index) || index >= tape->n_entries)
+    {
+        return 0;
     }
-#ifdef DEBUG
-    printf("____________________\n");
-#endif
+    return tape->grads[index];
 }
 
-// Compute gradients of outs, store pointers to Values with
-// val ∂ outs/ ∂w_i in buffer, where w_i is a node in the
-// compute DAG which produces outputs outs
-void get_gradients(VariablesGradAllocator *grad_alloc,
-                   Variable **independent_vars, int n_vars)
+// Free the memory of a variable: edge arrays and, for heap nodes, the node
+// itself. Arena nodes are left to arena_reset, user-owned nodes keep their
+// struct.
+void free_variable(Variable *var)
 {
-    if(grad_alloc == NULL || independent_vars == NULL){
+    if (var->storage == NN_STORAGE_ARENA)
+    {
+        var->local_grads = NULL;
+        var->children = NULL;
+        var->n_children = 0;
         return;
     }
-    
-    for (int root_index = 0; root_index < n_vars; root_index++)
-    {
-        Variable *indep_var = independent_vars[root_index];
-
-        grad_alloc->independent_vars =
-            (Variable **)realloc(grad_alloc->independent_vars, (root_index + 1) * sizeof(Variable *));
-        grad_alloc->independent_vars[root_index] = indep_var;
-        grad_alloc->n_indep_vars++;
 
-        compute_grads(grad_alloc, indep_var, 1.0);
+    free(var->local_grads);
+    free(var->children);
+    free(var->region);
+    var->region = NULL;
+    if (var->storage == NN_STORAGE_HEAP)
+    {
+        free(var);
+        return;
     }
+    var->local_grads = NULL;
+    var->children = NULL;
+    var->n_children = 0;
+}
+
+// Free var, which nothing references any more, and drop its references to its
+// children, freeing those whose count reaches 0 in turn. Every node is visited
+// once, on a heap-allocated stack rather than by recursion.
+void destroy_variable(Variable *var)
+{
+    size_t stack_cap = 64;
+    size_t depth = 0;
+    Variable **stack = (Variable **)malloc(stack_cap * sizeof(Variable *));
+    stack[depth++] = var;
+
+    while (depth > 0)
+    {
+        Variable *node = stack[--depth];
+        if (depth + node->n_children > stack_cap)
+        {
+            stack_cap = 2 * (depth + node->n_children);
+            stack = (Variable **)realloc(stack, stack_cap * sizeof(Variable *));
+        }
+        for (int i = 0; i < node->n_children; i++)
+        {
+            Variable *child = node->children[i];
+            if (node->storage == NN_STORAGE_ARENA && child->storage != NN_STORAGE_ARENA)
+            {
+                continue; // the arena drops this reference when it is reset
+            }
+            if (atomic_fetch_sub_explicit(&child->refcount, 1, memory_order_acq_rel) == 1)
+            {
+                stack[depth++] = child;
+            }
+        }
+
+        free_variable(node);
+    }
+
+    free(stack);
+}
+
+// Take a reference to var, keeping it (and the graph below it) alive until the
+// matching release_variable, e.g. to reuse an activation after the graph that
+// consumed it was freed
+void retain_variable(Variable *var)
+{
+    atomic_fetch_add_explicit(&var->refcount, 1, memory_order_relaxed);
+}
+
+// Drop a reference taken with retain_variable. The node is freed once no
+// parent or caller references it.
+void release_variable(Variable *var)
+{
+    if (var == NULL)
+    {
+        return;
+    }
+    if (atomic_load_explicit(&var->refcount, memory_order_acquire) == 0 ||
+        atomic_fetch_sub_explicit(&var->refcount, 1, memory_order_acq_rel) == 1)
+    {
+        destroy_variable(var);
+    }
+}
+
+// Free the graphs below outs: the outputs themselves and every node that is
+// not referenced from outside of them. Outputs may share nodes or be nodes of
+// each other's graphs; nodes still used elsewhere or retained by the caller
+// survive. Linear in the number of freed nodes.
+void free_graph(Variable **outs, size_t n_vars)
+{
+    // pin every output first, so one that sits below another is not freed
+    // while still being listed
+    for (size_t i = 0; i < n_vars; i++)
+    {
+        if (outs[i] != NULL)
+        {
+            retain_variable(outs[i]);
+        }
+    }
+    for (size_t i = 0; i < n_vars; i++)
+    {
+        release_variable(outs[i]);
+    }
+}
+
+// Free var and every node below it that is not referenced from elsewhere
+void free_from_variable(Variable *var)
+{
+    free_graph(&var, 1);
+}
+
+void print_variable(const Variable *var)
+{
+    printf("val: %lf, n_children: %d, children: %p, local_grads: %p\n", var->val,
+           var->n_children, (void *)var->children, (void *)var->local_grads);
+}
+
+// Initialize gradient buffer
+void init_grad_alloc(VariablesGradAllocator *var_grad_allocator)
+{
+    VariablesGradAllocator temp = {0};
+    *(var_grad_allocator) = temp;
+    var_grad_allocator->tag = next_epoch();
+}
+
+// Free the arrays owned by a gradient buffer
+void free_grad_buffers(VariablesGradAllocator *var_grad_allocator)
+{
+    free(var_grad_allocator->independent_vars);
+    free(var_grad_allocator->dependent_vars);
+    free(var_grad_allocator->grads);
+    var_map_free(&var_grad_allocator->grad_index);
+    free(var_grad_allocator->order);
+    free(var_grad_allocator->adjoints);
+    free(var_grad_allocator->first_edge);
+    free(var_grad_allocator->grad_slot);
+    free(var_grad_allocator->edges);
+    free(var_grad_allocator->stack);
+    free(var_grad_allocator->lanes);
+    var_map_free(&var_grad_allocator->visited);
+}
+
+// Free gradient buffer. The graphs it recorded are not touched; they are freed
+// through free_graph / release_variable by whoever owns them.
+void free_grad_alloc(VariablesGradAllocator *var_grad_allocator, size_t size)
+{
+    free_grad_buffers(var_grad_allocator);
+}
+
+//// CONTEXT /////
+
+// Initialize a context with its own id counter, gradient store and an arena
+// that its ops allocate from
+void graph_context_init(GraphContext *ctx)
+{
+    ctx->id = next_epoch();
+    ctx->next_id = 0;
+    arena_init(&ctx->node_arena, 0);
+    ctx->arena = &ctx->node_arena;
+    ctx->tape = NULL;
+    init_grad_alloc(&ctx->grad_alloc);
+    buffer_cache_init(&ctx->buffers);
+}
+
+// Drop every graph built in the context (reclaiming the arena in O(1)) and
+// its gradients, ready for the next step
+void graph_context_reset(GraphContext *ctx)
+{
+    ctx->grad_alloc.n_indep_vars = 0;
+    ctx->grad_alloc.n_dep_vars = 0;
+    ctx->grad_alloc.tag = next_epoch();
+    ctx->grad_alloc.swept = 0;
+    arena_reset(&ctx->node_arena);
+}
+
+void graph_context_free(GraphContext *ctx)
+{
+    free_grad_buffers(&ctx->grad_alloc);
+    arena_free(&ctx->node_arena);
+    buffer_cache_trim(&ctx->buffers);
+}
+
+pthread_key_t NN_DEFAULT_CONTEXT_KEY;
+pthread_once_t NN_DEFAULT_CONTEXT_ONCE = PTHREAD_ONCE_INIT;
+
+// Key destructor: frees a thread's default context when the thread exits
+void free_default_context(void *ctx)
+{
+    graph_context_free(ctx);
+    NN_DEFAULT_CONTEXT_READY = false;
+}
+
+void create_default_context_key(void)
+{
+    pthread_key_create(&NN_DEFAULT_CONTEXT_KEY, free_default_context);
+}
+
+// The context bound to the calling thread. Threads that bind none get their
+// own default context, which allocates from the heap and is freed when the
+// thread exits (the main thread's is left to process exit).
+GraphContext *graph_context(void)
+{
+    if (NN_CONTEXT != NULL)
+    {
+        return NN_CONTEXT;
+    }
+    if (!NN_DEFAULT_CONTEXT_READY)
+    {
+        graph_context_init(&NN_DEFAULT_CONTEXT);
+        NN_DEFAULT_CONTEXT.arena = NULL;
+        NN_DEFAULT_CONTEXT_READY = true;
+        pthread_once(&NN_DEFAULT_CONTEXT_ONCE, create_default_context_key);
+        pthread_setspecific(NN_DEFAULT_CONTEXT_KEY, &NN_DEFAULT_CONTEXT);
+    }
+    return &NN_DEFAULT_CONTEXT;
+}
+
+// Bind ctx to the calling thread (NULL: back to the thread's default context).
+// Returns the previously bound context.
+GraphContext *bind_graph_context(GraphContext *ctx)
+{
+    GraphContext *prev = NN_CONTEXT;
+    NN_CONTEXT = ctx;
+    return prev;
+}
+
+//// SCALAR OPS /////
+
+// Value of op applied to x (and y, for binary ops), with its local gradients
+// w.r.t. x and y written to local_grads
+nn_real eval_op(NNOp op, nn_real x, nn_real y, nn_real param, nn_real *local_grads)
+{
+    local_grads[1] = 0;
+    switch (op)
+    {
+    case NN_OP_ADD:
+        local_grads[0] = 1;
+        local_grads[1] = 1;
+        return x + y;
+    case NN_OP_SUB:
+        local_grads[0] = 1;
+        local_grads[1] = -1;
+        return x - y;
+    case NN_OP_MUL:
+        local_grads[0] = y;
+        local_grads[1] = x;
+        return x * y;
+    case NN_OP_SIGMOID:
+    {
+        nn_real sigmoid_val = 1 / (1 + exp(-x));
+        local_grads[0] = sigmoid_val * (1 - sigmoid_val);
+        return sigmoid_val;
+    }
+    case NN_OP_RELU:
+        local_grads[0] = x < 0 ? 0 : 1;
+        return (x > 0) ? x : 0;
+    case NN_OP_POWER:
+        local_grads[0] = param * pow(x, param - 1);
+        return pow(x, param);
+    default:
+        local_grads[0] = 1;
+        return x;
+    }
+}
+
+// Take the reference parent holds on its operand child. For a node in an arena
+// and a child outside of it, the arena owns the reference.
+void hold_operand(Variable *parent, Variable *child)
+{
+    retain_variable(child);
+    if (parent->storage == NN_STORAGE_ARENA && child->storage != NN_STORAGE_ARENA)
+    {
+        arena_hold(graph_context()->arena, child);
+    }
+}
+
+// Builds the result of op on x (and y, NULL for unary ops): an entry on the
+// bound tape if there is one, otherwise a graph node linked to its children
+Variable *record_op(NNOp op, Variable *x, Variable *y, nn_real param)
+{
+    nn_real local_grads[2];
+    nn_real value = eval_op(op, x->val, y == NULL ? 0 : y->val, param, local_grads);
+
+    Tape *tape = graph_context()->tape;
+    if (tape != NULL)
+    {
+        return tape_record(tape, op, x, y, value, local_grads[0], local_grads[1]);
+    }
+
+    // Create a new Variable with the computed value and room for its connections
+    Variable *newValue = new_op_var(value, y == NULL ? 1 : 2);
+    newValue->op = op;
+    newValue->param = param;
+
+    // Set up children and local gradients, the new node holds a reference to each
+    newValue->children[0] = x;
+    newValue->local_grads[0] = local_grads[0];
+    hold_operand(newValue, x);
+    newValue->requires_grad = x->requires_grad;
+    if (y != NULL)
+    {
+        newValue->children[1] = y;
+        newValue->local_grads[1] = local_grads[1];
+        hold_operand(newValue, y);
+        newValue->requires_grad |= y->requires_grad;
+    }
+
+    return newValue;
+}
+
+// Builds the compute graph for addition between scalar variables
+Variable *add(Variable *x, Variable *y)
+{
+    return record_op(NN_OP_ADD, x, y, 0);
+}
+
+// Builds the compute graph for subtraction between scalar variables
+Variable *sub(Variable *x, Variable *y)
+{
+    return record_op(NN_OP_SUB, x, y, 0);
+}
+
+// Builds the compute graph for multiplication between scalar variables
+Variable *mul(Variable *x, Variable *y)
+{
+    return record_op(NN_OP_MUL, x, y, 0);
+}
+
+// Builds the compute graph for the sigmoid function on a scalar variable
+Variable *sigmoid(Variable *x)
+{
+    return record_op(NN_OP_SIGMOID, x, NULL, 0);
+}
+
+// Builds the compute graph for the ReLU function on a scalar variable
+Variable *relu(Variable *x)
+{
+    return record_op(NN_OP_RELU, x, NULL, 0);
+}
+
+Variable *power(Variable *x, nn_real n)
+{
+    return record_op(NN_OP_POWER, x, NULL, n);
+}
+
+void checkpoint_local_grads(Variable *var);
+
+// A leaf holding value that needs no gradient. Unlike init_var it is
+// allocated like an op result, so it is freed along with the graph using it.
+Variable *constant(nn_real value)
+{
+    return new_op_var(value, 0);
+}
+
+// A node's traversal state lives on the node only if the sorting thread's
+// context built it; any other node (leaves, nodes of other threads) is looked
+// up in the allocator, so shared nodes are never written by a pass.
+bool owns_node(const VariablesGradAllocator *grad_alloc, const Variable *var)
+{
+    return var->context != 0 && var->context == grad_alloc->context;
+}
+
+// Marks var as reached in the current epoch. Returns false if it already was,
+// with its slot in *slot (a reached node is already in order, the graph being
+// acyclic).
+bool visit_var(VariablesGradAllocator *grad_alloc, Variable *var, size_t *slot)
+{
+    if (owns_node(grad_alloc, var))
+    {
+        if (var->mark == grad_alloc->epoch)
+        {
+            *slot = var->slot;
+            return false;
+        }
+        var->mark = grad_alloc->epoch;
+        return true;
+    }
+    bool inserted;
+    *slot = *var_map_insert(&grad_alloc->visited, var, &inserted);
+    return inserted;
+}
+
+// Records var at position slot of the current order
+void set_slot(VariablesGradAllocator *grad_alloc, Variable *var, size_t slot)
+{
+    if (owns_node(grad_alloc, var))
+    {
+        var->mark = grad_alloc->epoch;
+        var->slot = slot;
+        return;
+    }
+    bool inserted;
+    *var_map_insert(&grad_alloc->visited, var, &inserted) = slot;
+}
+
+// Position of var in the order of the last sort_graph of grad_alloc, false
+// if that sort did not reach var. Owned nodes carry their slot, unless a
+// later sort in the same context restamped them; the first such miss adds
+// the owned part of the order to visited.
+bool sorted_slot(VariablesGradAllocator *grad_alloc, const Variable *var, size_t *slot)
+{
+    if (owns_node(grad_alloc, var) && var->mark == grad_alloc->epoch)
+    {
+        *slot = var->slot;
+        return true;
+    }
+    if (owns_node(grad_alloc, var) && !grad_alloc->indexed)
+    {
+        grad_alloc->indexed = true;
+        for (size_t idx = 0; idx < grad_alloc->n_order; idx++)
+        {
+            bool inserted;
+            *var_map_insert(&grad_alloc->visited, grad_alloc->order[idx], &inserted) = idx;
+        }
+    }
+    const size_t *found = var_map_find(&grad_alloc->visited, var);
+    if (found != NULL)
+    {
+        *slot = *found;
+    }
+    return found != NULL;
+}
+
+// Reserve n edges, returns the index of the first
+size_t reserve_edges(VariablesGradAllocator *grad_alloc, size_t n)
+{
+    size_t first = grad_alloc->n_edges;
+    grad_alloc->n_edges += n;
+    if (grad_alloc->n_edges > grad_alloc->edges_cap)
+    {
+        grad_alloc->edges_cap = grad_alloc->n_edges > 2 * grad_alloc->edges_cap ? grad_alloc->n_edges
+                                                                                : 2 * grad_alloc->edges_cap;
+        grad_alloc->edges = (size_t *)realloc(grad_alloc->edges, grad_alloc->edges_cap * sizeof(size_t));
+    }
+    return first;
+}
+
+// Post-order DFS from var: appends every node reachable from var that was
+// not reached yet in this epoch to grad_alloc->order, so that each node comes
+// after all of its children, and records its position in slot. Children that
+// need no gradient (neither requires_grad nor can_grad set) are not descended
+// into, unless grad_alloc->keep_constants is set. Each child edge of an
+// appended node gets the child's slot in edges. The walk keeps its own stack
+// on the heap, so graph depth is not limited by the C stack. Returns the new
+// length of order. The epoch is the one sort_graph set on grad_alloc.
+size_t topo_sort(VariablesGradAllocator *grad_alloc, Variable *var, size_t n_order)
+{
+    size_t slot;
+    if (!visit_var(grad_alloc, var, &slot))
+    {
+        return n_order;
+    }
+
+    if (grad_alloc->stack_cap == 0)
+    {
+        grad_alloc->stack_cap = 64;
+        grad_alloc->stack = (VisitFrame *)malloc(grad_alloc->stack_cap * sizeof(VisitFrame));
+    }
+    VisitFrame *stack = grad_alloc->stack;
+    size_t depth = 0;
+    stack[depth].var = var;
+    stack[depth].next_child = 0;
+    stack[depth].edge = reserve_edges(grad_alloc, var->n_children);
+    depth++;
+
+    while (depth > 0)
+    {
+        VisitFrame *frame = &stack[depth - 1];
+        if (frame->next_child < frame->var->n_children)
+        {
+            size_t *edge = &grad_alloc->edges[frame->edge + frame->next_child];
+            Variable *child = frame->var->children[frame->next_child++];
+            *edge = SIZE_MAX;
+            if (!(child->requires_grad || child->can_grad || grad_alloc->keep_constants) ||
+                !visit_var(grad_alloc, child, edge))
+            {
+                continue;
+            }
+
+            if (depth == grad_alloc->stack_cap)
+            {
+                grad_alloc->stack_cap *= 2;
+                grad_alloc->stack = (VisitFrame *)realloc(stack, grad_alloc->stack_cap * sizeof(VisitFrame));
+                stack = grad_alloc->stack;
+            }
+            stack[depth].var = child;
+            stack[depth].next_child = 0;
+            stack[depth].edge = reserve_edges(grad_alloc, child->n_children);
+            depth++;
+            continue;
+        }
+
+        // all children are in order, so the node can follow them. A checkpoint
+        // node gets its local grads now, the first time backward needs them.
+        if (frame->var->op == NN_OP_CHECKPOINT && !frame->var->region->ready && !grad_alloc->graph_regions)
+        {
+            checkpoint_local_grads(frame->var);
+        }
+        if (n_order == grad_alloc->order_cap)
+        {
+            grad_alloc->order_cap = grad_alloc->order_cap == 0 ? 64 : grad_alloc->order_cap * 2;
+            grad_alloc->order = (Variable **)realloc(grad_alloc->order, grad_alloc->order_cap * sizeof(Variable *));
+            grad_alloc->adjoints = (nn_real *)realloc(grad_alloc->adjoints, grad_alloc->order_cap * sizeof(nn_real));
+            grad_alloc->first_edge = (size_t *)realloc(grad_alloc->first_edge, grad_alloc->order_cap * sizeof(size_t));
+            grad_alloc->grad_slot = (size_t *)realloc(grad_alloc->grad_slot, grad_alloc->order_cap * sizeof(size_t));
+        }
+        set_slot(grad_alloc, frame->var, n_order);
+        grad_alloc->first_edge[n_order] = frame->edge;
+        grad_alloc->order[n_order] = frame->var;
+        depth--;
+        if (depth > 0)
+        {
+            VisitFrame *parent = &stack[depth - 1];
+            grad_alloc->edges[parent->edge + parent->next_child - 1] = n_order;
+        }
+        n_order++;
+    }
+
+    return n_order;
+}
+
+// Build grad_index from dependent_vars, unless it is current
+void index_grads(VariablesGradAllocator *grad_alloc)
+{
+    if (grad_alloc->grad_index.stamp == grad_alloc->tag)
+    {
+        return;
+    }
+    var_map_reset(&grad_alloc->grad_index, grad_alloc->tag);
+    for (size_t idx = 0; idx < grad_alloc->n_dep_vars; idx++)
+    {
+        bool inserted;
+        *var_map_insert(&grad_alloc->grad_index, grad_alloc->dependent_vars[idx], &inserted) = idx;
+    }
+}
+
+// Index of var in dependent_vars, registering it with a zeroed gradient the
+// first time this allocator reaches it. The first pass after a new tag reaches
+// every node once, so it just appends; later passes look nodes up in
+// grad_index, which is built then.
+size_t dependent_index(VariablesGradAllocator *grad_alloc, Variable *var, bool first_pass)
+{
+    size_t *index = NULL;
+    if (!first_pass)
+    {
+        index_grads(grad_alloc);
+        bool inserted;
+        index = var_map_insert(&grad_alloc->grad_index, var, &inserted);
+        if (!inserted)
+        {
+            return *index;
+        }
+    }
+
+    if (grad_alloc->n_dep_vars == grad_alloc->dep_cap)
+    {
+        grad_alloc->dep_cap = grad_alloc->dep_cap == 0 ? 16 : grad_alloc->dep_cap * 2;
+        grad_alloc->dependent_vars = (Variable **)realloc(
+            grad_alloc->dependent_vars, grad_alloc->dep_cap * sizeof(Variable *));
+        grad_alloc->grads = (nn_real *)realloc(grad_alloc->grads, grad_alloc->dep_cap * sizeof(nn_real));
+    }
+    size_t new_index = grad_alloc->n_dep_vars++;
+    grad_alloc->dependent_vars[new_index] = var;
+    grad_alloc->grads[new_index] = 0;
+    if (index != NULL)
+    {
+        *index = new_index;
+    }
+    return new_index;
+}
+
+// Add the adjoints of the n_order sorted nodes with can_grad set to their
+// gradients, once a sweep is done
+void collect_grads(VariablesGradAllocator *grad_alloc, size_t n_order)
+{
+    bool first_pass = grad_alloc->n_dep_vars == 0;
+    for (size_t slot = n_order; slot-- > 0;)
+    {
+        Variable *var = grad_alloc->order[slot];
+        grad_alloc->grad_slot[slot] = SIZE_MAX;
+        if (var->can_grad)
+        {
+            size_t index = dependent_index(grad_alloc, var, first_pass);
+            grad_alloc->grads[index] += grad_alloc->adjoints[slot];
+            grad_alloc->grad_slot[slot] = index;
+        }
+    }
+    grad_alloc->swept = grad_alloc->epoch;
+}
+
+// Sorts the union of the DAGs below roots topologically into
+// grad_alloc->order, under a fresh epoch. Returns the number of nodes reached.
+size_t sort_graph(VariablesGradAllocator *grad_alloc, Variable **roots, size_t n_roots)
+{
+    grad_alloc->epoch = next_epoch();
+    grad_alloc->context = graph_context()->id;
+    grad_alloc->n_order = 0;
+    grad_alloc->n_edges = 0;
+    grad_alloc->indexed = false;
+    var_map_reset(&grad_alloc->visited, grad_alloc->epoch);
+    size_t n_order = 0;
+    for (size_t root_idx = 0; root_idx < n_roots; root_idx++)
+    {
+        if (roots[root_idx] != NULL)
+        {
+            n_order = topo_sort(grad_alloc, roots[root_idx], n_order);
+        }
+    }
+    grad_alloc->n_order = n_order;
+    return n_order;
+}
+
+// Zero the adjoints of the n_order sorted nodes, then add seeds[i] at roots[i]
+// (1 for every root if seeds is NULL)
+void seed_adjoints(VariablesGradAllocator *grad_alloc, size_t n_order,
+                   Variable **roots, const nn_real *seeds, size_t n_roots)
+{
+    memset(grad_alloc->adjoints, 0, n_order * sizeof(nn_real));
+    for (size_t root_idx = 0; root_idx < n_roots; root_idx++)
+    {
+        size_t slot;
+        if (roots[root_idx] != NULL && sorted_slot(grad_alloc, roots[root_idx], &slot))
+        {
+            grad_alloc->adjoints[slot] += seeds == NULL ? 1 : seeds[root_idx];
+        }
+    }
+}
+
+// Sweep the n_order sorted nodes in reverse, pushing each adjoint to the
+// children, then accumulate gradients of nodes with can_grad set
+void sweep_adjoints(VariablesGradAllocator *grad_alloc, size_t n_order)
+{
+    nn_real *adjoints = grad_alloc->adjoints;
+
+    // every node is reached after all of its parents
+    for (size_t slot = n_order; slot-- > 0;)
+    {
+        Variable *var = grad_alloc->order[slot];
+        const size_t *edges = grad_alloc->edges + grad_alloc->first_edge[slot];
+        nn_real adjoint = adjoints[slot];
+
+        for (int child_idx = 0; child_idx < var->n_children; child_idx++)
+        {
+            if (edges[child_idx] != SIZE_MAX)
+            {
+                adjoints[edges[child_idx]] += adjoint * var->local_grads[child_idx];
+            }
+        }
+    }
+    collect_grads(grad_alloc, n_order);
+#ifdef DEBUG
+    printf("swept %zu nodes\n", n_order);
+#endif
+}
+
+// One reverse sweep over the DAG below roots, seeded with the adjoint
+// seeds[i] at roots[i] (1 for every root if seeds is NULL). The DAG is sorted
+// once and every edge is visited exactly once, no matter how many roots or
+// paths lead to a node. Adjoints live in a dense array indexed by each node's
+// slot in the order, and gradients of nodes with can_grad set are
+// accumulated in grad_alloc.
+void backward_pass(VariablesGradAllocator *grad_alloc, Variable **roots,
+                   const nn_real *seeds, size_t n_roots)
+{
+    size_t n_order = sort_graph(grad_alloc, roots, n_roots);
+    if (n_order == 0)
+    {
+        return;
+    }
+
+    seed_adjoints(grad_alloc, n_order, roots, seeds, n_roots);
+    sweep_adjoints(grad_alloc, n_order);
+}
+
+// Helper function for get_gradients. Accumulates the gradients of
+// independent_var, scaled by path_value, into the nodes below it.
+void compute_grads(VariablesGradAllocator *grad_alloc,
+                   Variable *independent_var, nn_real path_value)
+{
+    if (independent_var == NULL || grad_alloc == NULL)
+    {
+        return;
+    }
+
+    backward_pass(grad_alloc, &independent_var, &path_value, 1);
+}
+
+// Append roots to the independent vars of grad_alloc
+void record_roots(VariablesGradAllocator *grad_alloc, Variable **independent_vars, int n_vars)
+{
+    for (int root_index = 0; root_index < n_vars; root_index++)
+    {
+        if (grad_alloc->n_indep_vars == grad_alloc->indep_cap)
+        {
+            grad_alloc->indep_cap = grad_alloc->indep_cap == 0 ? 4 : grad_alloc->indep_cap * 2;
+            grad_alloc->independent_vars = (Variable **)realloc(
+                grad_alloc->independent_vars, grad_alloc->indep_cap * sizeof(Variable *));
+        }
+        grad_alloc->independent_vars[grad_alloc->n_indep_vars++] = independent_vars[root_index];
+    }
+}
+
+// Vector-Jacobian product of outs: like get_gradients, but the gradient of
+// independent_vars[i] is seeded with seeds[i] (e.g. dL/dy_i) instead of 1, so
+// dependent vars end up with sum_i seeds[i] * ∂ outs_i/ ∂w. All outputs share
+// one reverse sweep.
+void get_gradients_seeded(VariablesGradAllocator *grad_alloc,
+                          Variable **independent_vars, const nn_real *seeds, int n_vars)
+{
+    if (grad_alloc == NULL || independent_vars == NULL)
+    {
+        return;
+    }
+
+    record_roots(grad_alloc, independent_vars, n_vars);
+    backward_pass(grad_alloc, independent_vars, seeds, n_vars);
+}
+
+// Compute gradients of outs, store pointers to the nodes w_i with can_grad
+// set in dependent_vars, with ∂ outs/ ∂w_i in grads[i], where w_i is a
+// node in the compute DAG which produces outputs outs
+void get_gradients(VariablesGradAllocator *grad_alloc,
+                   Variable **independent_vars, int n_vars)
+{
+    get_gradients_seeded(grad_alloc, independent_vars, NULL, n_vars);
+}
+
+// Gradient accumulated by grad_alloc w.r.t. var (0 if var was not reached or
+// does not have can_grad set). Nodes reached by the last pass are found
+// through its order; reading grads alongside dependent_vars needs no lookup.
+nn_real get_gradient(VariablesGradAllocator *grad_alloc, Variable *var)
+{
+    size_t slot;
+    if (grad_alloc->swept != 0 && grad_alloc->swept == grad_alloc->epoch && sorted_slot(grad_alloc, var, &slot))
+    {
+        return grad_alloc->grad_slot[slot] == SIZE_MAX ? 0 : grad_alloc->grads[grad_alloc->grad_slot[slot]];
+    }
+    if (grad_alloc->n_dep_vars == 0 || !var->can_grad)
+    {
+        return 0;
+    }
+    index_grads(grad_alloc);
+    const size_t *index = var_map_find(&grad_alloc->grad_index, var);
+    return index != NULL ? grad_alloc->grads[*index] : 0;
+}
+
+// Batched reverse sweep: lane i of every node's adjoint is seeded at roots[i]
+// (at most NN_LANES roots), so one traversal yields the gradients of all
+// roots, e.g. NN_LANES rows of a Jacobian. Edges are visited once and the
+// lanes are updated together in vector registers. Results are read with
+// get_gradient_lane and stay valid until grad_alloc runs another pass, even
+// if other allocators sort the same nodes; grads and dependent_vars are not
+// touched.
+void get_gradients_lanes(VariablesGradAllocator *grad_alloc, Variable **roots, size_t n_roots)
+{
+    if (grad_alloc == NULL || roots == NULL || n_roots > NN_LANES)
+    {
+        return;
+    }
+
+    size_t n_order = sort_graph(grad_alloc, roots, n_roots);
+    if (n_order > grad_alloc->lanes_cap)
+    {
+        // vector loads want the lanes aligned to their full width
+        free(grad_alloc->lanes);
+        grad_alloc->lanes_cap = grad_alloc->order_cap;
+        grad_alloc->lanes = (Lanes *)aligned_alloc(sizeof(Lanes), grad_alloc->lanes_cap * sizeof(Lanes));
+    }
+    Lanes *lanes = grad_alloc->lanes;
+    memset(lanes, 0, n_order * sizeof(Lanes));
+    for (size_t root_idx = 0; root_idx < n_roots; root_idx++)
+    {
+        size_t slot;
+        if (roots[root_idx] != NULL && sorted_slot(grad_alloc, roots[root_idx], &slot))
+        {
+            lanes[slot][root_idx] += 1;
+        }
+    }
+
+    for (size_t slot = n_order; slot-- > 0;)
+    {
+        Variable *var = grad_alloc->order[slot];
+        const size_t *edges = grad_alloc->edges + grad_alloc->first_edge[slot];
+        Lanes adjoint = lanes[slot];
+        for (int child_idx = 0; child_idx < var->n_children; child_idx++)
+        {
+            if (edges[child_idx] != SIZE_MAX)
+            {
+                lanes[edges[child_idx]] += adjoint * var->local_grads[child_idx];
+            }
+        }
+    }
+}
+
+// Gradient of the root seeded in lane by the last get_gradients_lanes of
+// grad_alloc w.r.t. var (0 if var was not reached)
+nn_real get_gradient_lane(VariablesGradAllocator *grad_alloc, Variable *var, size_t lane)
+{
+    size_t slot;
+    if (grad_alloc->lanes == NULL || lane >= NN_LANES || !sorted_slot(grad_alloc, var, &slot))
+    {
+        return 0;
+    }
+    return grad_alloc->lanes[slot][lane];
+}
+
+//// CHECKPOINTS /////
+
+// Run the region on fresh leaves holding the current values of inputs (one
+// per input, written to proxies). The region is built on the heap, even with
+// an arena or tape bound, so it can be dropped right away.
+Variable *run_region(Checkpoint *region, Variable **inputs, size_t n_inputs,
+                     Variable *proxies, Variable **proxy_ptrs)
+{
+    for (size_t idx = 0; idx < n_inputs; idx++)
+    {
+        init_var(&proxies[idx], inputs[idx]->val, true);
+        proxy_ptrs[idx] = &proxies[idx];
+    }
+
+    GraphContext *ctx = graph_context();
+    Arena *prev_arena = ctx->arena;
+    Tape *prev_tape = ctx->tape;
+    ctx->arena = NULL;
+    ctx->tape = NULL;
+    Variable *out = region->fn(proxy_ptrs, n_inputs, region->arg);
+    ctx->arena = prev_arena;
+    ctx->tape = prev_tape;
+    return out;
+}
+
+// Rebuild the region of a checkpoint node and differentiate it, storing the
+// gradient w.r.t. each input as the node's local grads. The interior is freed
+// again once they are known.
+void checkpoint_local_grads(Variable *var)
+{
+    size_t n_inputs = var->n_children;
+    Variable *proxies = (Variable *)malloc(n_inputs * sizeof(Variable));
+    Variable **proxy_ptrs = (Variable **)malloc(n_inputs * sizeof(Variable *));
+    Variable *out = run_region(var->region, var->children, n_inputs, proxies, proxy_ptrs);
+
+    VariablesGradAllocator grad_alloc;
+    init_grad_alloc(&grad_alloc);
+    get_gradients(&grad_alloc, &out, 1);
+    for (size_t idx = 0; idx < n_inputs; idx++)
+    {
+        var->local_grads[idx] = get_gradient(&grad_alloc, proxy_ptrs[idx]);
+    }
+    var->region->ready = true;
+
+    free_grad_buffers(&grad_alloc);
+    free_from_variable(out);
+    free(proxy_ptrs);
+    free(proxies);
+}
+
+// Run fn on inputs as a checkpoint region: only its output value is kept, as
+// a node whose operands are inputs, and the interior is freed right after
+// forward. Backward rebuilds the region to get the node's local grads, so a
+// chain of k regions over an N node graph peaks at about N/k + k nodes
+// instead of N. With a tape bound the region is simply recorded on it.
+// program_capture refuses graphs that contain checkpoint nodes.
+Variable *checkpoint(CheckpointFn fn, Variable **inputs, size_t n_inputs, void *arg)
+{
+    if (graph_context()->tape != NULL)
+    {
+        return fn(inputs, n_inputs, arg);
+    }
+
+    Checkpoint region = {fn, arg, false};
+    Variable *proxies = (Variable *)malloc(n_inputs * sizeof(Variable));
+    Variable **proxy_ptrs = (Variable **)malloc(n_inputs * sizeof(Variable *));
+    Variable *out = run_region(&region, inputs, n_inputs, proxies, proxy_ptrs);
+    nn_real value = out->val;
+    free_from_variable(out);
+    free(proxy_ptrs);
+    free(proxies);
+
+    Variable *var = new_op_var(value, (int)n_inputs);
+    var->op = NN_OP_CHECKPOINT;
+    var->region = var->storage == NN_STORAGE_ARENA
+                      ? (Checkpoint *)arena_alloc(graph_context()->arena, sizeof(Checkpoint))
+                      : (Checkpoint *)malloc(sizeof(Checkpoint));
+    *var->region = region;
+    for (size_t idx = 0; idx < n_inputs; idx++)
+    {
+        var->children[idx] = inputs[idx];
+        var->local_grads[idx] = 0;
+        hold_operand(var, inputs[idx]);
+        var->requires_grad |= inputs[idx]->requires_grad;
+    }
+    return var;
+}
+
+//// HIGHER ORDER /////
+
+void get_gradients_graph(Variable **roots, const nn_real *seeds, size_t n_roots,
+                         Variable **wrt, Variable **grads, size_t n_wrt);
+
+// Local gradient of var w.r.t. its child_idx-th operand, built from the ops so
+// it can be differentiated again. NULL stands for the constant 1.
+Variable *local_grad_var(Variable *var, int child_idx)
+{
+    switch (var->op)
+    {
+    case NN_OP_ADD:
+        return NULL;
+    case NN_OP_SUB:
+        return child_idx == 0 ? NULL : constant(-1);
+    case NN_OP_MUL:
+        return var->children[1 - child_idx];
+    case NN_OP_SIGMOID:
+        return mul(var, sub(constant(1), var));
+    case NN_OP_POWER:
+        return mul(constant(var->param), power(var->children[0], var->param - 1));
+    default:
+        // piecewise constant (relu)
+        return var->local_grads[child_idx] == 1 ? NULL : constant(var->local_grads[child_idx]);
+    }
+}
+
+// Backward recorded as a graph: grads[i] becomes a node computing
+// sum_j seeds[j] * ∂ roots_j/ ∂ wrt_i (seeds NULL means 1 for every root),
+// built with the scalar ops so it can be differentiated again, e.g. for
+// Hessian-vector products or gradient penalties. wrt nodes not below roots
+// get a constant 0. The gradient nodes are owned by the caller, like any op
+// result, and reference the original graph.
+void get_gradients_graph(Variable **roots, const nn_real *seeds, size_t n_roots,
+                         Variable **wrt, Variable **grads, size_t n_wrt)
+{
+    VariablesGradAllocator sorter;
+    init_grad_alloc(&sorter);
+    sorter.graph_regions = true;
+    size_t n_order = sort_graph(&sorter, roots, n_roots);
+
+    // Checkpoint regions are rebuilt on their operands and differentiated as
+    // graphs up front
+    size_t n_region_grads = 0;
+    size_t *region_first = (size_t *)malloc((n_order + 1) * sizeof(size_t));
+    for (size_t slot = 0; slot < n_order; slot++)
+    {
+        region_first[slot] = n_region_grads;
+        if (sorter.order[slot]->op == NN_OP_CHECKPOINT)
+        {
+            n_region_grads += sorter.order[slot]->n_children;
+        }
+    }
+    Variable **region_grads = (Variable **)malloc((n_region_grads + 1) * sizeof(Variable *));
+    for (size_t slot = 0; slot < n_order; slot++)
+    {
+        Variable *var = sorter.order[slot];
+        if (var->op != NN_OP_CHECKPOINT)
+        {
+            continue;
+        }
+        Variable **local = &region_grads[region_first[slot]];
+        Variable *region_out = var->region->fn(var->children, var->n_children, var->region->arg);
+        get_gradients_graph(&region_out, NULL, 1, var->children, local, var->n_children);
+        for (int child_idx = 0; child_idx < var->n_children; child_idx++)
+        {
+            retain_variable(local[child_idx]);
+        }
+        free_from_variable(region_out);
+    }
+
+    Variable **adjoints = (Variable **)calloc(n_order + 1, sizeof(Variable *));
+    for (size_t root_idx = 0; root_idx < n_roots; root_idx++)
+    {
+        size_t slot;
+        if (roots[root_idx] == NULL || !sorted_slot(&sorter, roots[root_idx], &slot))
+        {
+            continue;
+        }
+        Variable **adjoint = &adjoints[slot];
+        Variable *seed = constant(seeds == NULL ? 1 : seeds[root_idx]);
+        *adjoint = *adjoint == NULL ? seed : add(*adjoint, seed);
+    }
+
+    // the sweep of backward_pass, with every product and sum recorded
+    for (size_t slot = n_order; slot-- > 0;)
+    {
+        Variable *var = sorter.order[slot];
+        if (adjoints[slot] == NULL)
+        {
+            continue;
+        }
+        const size_t *edges = sorter.edges + sorter.first_edge[slot];
+        for (int child_idx = 0; child_idx < var->n_children; child_idx++)
+        {
+            size_t child_slot = edges[child_idx];
+            if (child_slot == SIZE_MAX)
+            {
+                continue;
+            }
+            Variable *local = var->op == NN_OP_CHECKPOINT ? region_grads[region_first[slot] + child_idx]
+                                                          : local_grad_var(var, child_idx);
+            Variable *contrib = local == NULL ? adjoints[slot] : mul(adjoints[slot], local);
+            Variable **adjoint = &adjoints[child_slot];
+            *adjoint = *adjoint == NULL ? contrib : add(*adjoint, contrib);
+        }
+    }
+
+    for (size_t idx = 0; idx < n_wrt; idx++)
+    {
+        size_t slot;
+        bool reached = sorted_slot(&sorter, wrt[idx], &slot) && adjoints[slot] != NULL;
+        grads[idx] = reached ? adjoints[slot] : constant(0);
+        retain_variable(grads[idx]);
+    }
+
+    // Free the adjoints the gradients do not use. The original nodes are pinned
+    // meanwhile, so dropping references to them cannot free them.
+    for (size_t slot = 0; slot < n_order; slot++)
+    {
+        retain_variable(sorter.order[slot]);
+    }
+    free_graph(adjoints, n_order);
+    for (size_t idx = 0; idx < n_region_grads; idx++)
+    {
+        release_variable(region_grads[idx]);
+    }
+    for (size_t slot = 0; slot < n_order; slot++)
+    {
+        atomic_fetch_sub_explicit(&sorter.order[slot]->refcount, 1, memory_order_relaxed);
+    }
+    for (size_t idx = 0; idx < n_wrt; idx++)
+    {
+        atomic_fetch_sub_explicit(&grads[idx]->refcount, 1, memory_order_relaxed);
+    }
+
+    free(adjoints);
+    free(region_grads);
+    free(region_first);
+    free_grad_buffers(&sorter);
+}
+
+//// PARALLEL BACKWARD /////
+
+void *thread_pool_worker(void *arg);
+
+// Start n_threads workers. Jobs run on n_threads + 1 workers, the thread
+// calling thread_pool_run being worker 0.
+void thread_pool_init(ThreadPool *pool, size_t n_threads)
+{
+    pool->n_threads = n_threads;
+    pool->threads = (pthread_t *)malloc(n_threads * sizeof(pthread_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->job = NULL;
+    pool->job_arg = NULL;
+    pool->generation = 0;
+    pool->n_running = 0;
+    pool->stop = false;
+    // workers look themselves up in threads, so hold them off until it is filled
+    pthread_mutex_lock(&pool->lock);
+    for (size_t idx = 0; idx < n_threads; idx++)
+    {
+        pthread_create(&pool->threads[idx], NULL, thread_pool_worker, pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Worker loop: wait for a new generation, run its job, report back
+void *thread_pool_worker(void *arg)
+{
+    ThreadPool *pool = (ThreadPool *)arg;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    // workers are numbered by start order, after the calling thread
+    size_t worker = 1;
+    while (worker <= pool->n_threads && !pthread_equal(pool->threads[worker - 1], pthread_self()))
+    {
+        worker++;
+    }
+    for (;;)
+    {
+        while (!pool->stop && pool->generation == seen)
+        {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stop)
+        {
+            break;
+        }
+        seen = pool->generation;
+        void (*job)(void *, size_t) = pool->job;
+        void *job_arg = pool->job_arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        job(job_arg, worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->n_running == 0)
+        {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Run job(arg, worker) on every worker, including the calling thread as
+// worker 0, and wait until all of them have returned
+void thread_pool_run(ThreadPool *pool, void (*job)(void *arg, size_t worker), void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->job_arg = arg;
+    pool->n_running = pool->n_threads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    job(arg, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->n_running > 0)
+    {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_free(ThreadPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t idx = 0; idx < pool->n_threads; idx++)
+    {
+        pthread_join(pool->threads[idx], NULL);
+    }
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+}
+
+void deque_push(WorkDeque *deque, size_t item)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->cap && deque->head > 0)
+    {
+        // reclaim the stolen prefix before growing
+        memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(size_t));
+        deque->tail -= deque->head;
+        deque->head = 0;
+    }
+    if (deque->tail == deque->cap)
+    {
+        deque->cap = deque->cap == 0 ? 64 : deque->cap * 2;
+        deque->items = (size_t *)realloc(deque->items, deque->cap * sizeof(size_t));
+    }
+    deque->items[deque->tail++] = item;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// Take the newest item (owner side), returns false if the deque is empty
+bool deque_pop(WorkDeque *deque, size_t *item)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->tail > deque->head;
+    if (found)
+    {
+        *item = deque->items[--deque->tail];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Take the oldest item (thief side), returns false if the deque is empty
+bool deque_steal(WorkDeque *deque, size_t *item)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->tail > deque->head;
+    if (found)
+    {
+        *item = deque->items[deque->head++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Atomically adds value to *target
+void atomic_add_real(_Atomic nn_real *target, nn_real value)
+{
+    nn_real expected = atomic_load_explicit(target, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak(target, &expected, expected + value))
+    {
+    }
+}
+
+// Worker of a parallel sweep. A node is swept once all of its parents have
+// been, which the last of them signals by dropping its pending count to 0;
+// that parent then sweeps one ready child itself and pushes the others onto
+// its deque for idle workers to steal.
+void parallel_sweep_worker(void *arg, size_t worker)
+{
+    ParallelSweep *sweep = (ParallelSweep *)arg;
+    WorkDeque *own = &sweep->deques[worker];
+
+    while (atomic_load(&sweep->remaining) > 0)
+    {
+        size_t slot;
+        bool found = deque_pop(own, &slot);
+        for (size_t offset = 1; !found && offset < sweep->n_workers; offset++)
+        {
+            found = deque_steal(&sweep->deques[(worker + offset) % sweep->n_workers], &slot);
+        }
+        if (!found)
+        {
+            sched_yield();
+            continue;
+        }
+
+        for (;;)
+        {
+            Variable *var = sweep->order[slot];
+            nn_real adjoint = atomic_load(&sweep->adjoints[slot]);
+            bool has_next = false;
+            size_t next = 0;
+
+            const size_t *edges = sweep->edges + sweep->first_edge[slot];
+            for (int child_idx = 0; child_idx < var->n_children; child_idx++)
+            {
+                size_t child_slot = edges[child_idx];
+                if (child_slot == SIZE_MAX)
+                {
+                    continue;
+                }
+                atomic_add_real(&sweep->adjoints[child_slot], adjoint * var->local_grads[child_idx]);
+                if (atomic_fetch_sub(&sweep->pending[child_slot], 1) == 1)
+                {
+                    if (!has_next)
+                    {
+                        next = child_slot;
+                        has_next = true;
+                    }
+                    else
+                    {
+                        deque_push(own, child_slot);
+                    }
+                }
+            }
+
+            atomic_fetch_sub(&sweep->remaining, 1);
+            if (!has_next)
+            {
+                break;
+            }
+            slot = next;
+        }
+    }
+}
+
+// Like get_gradients_seeded, but the reverse sweep runs on the workers of
+// pool. Nodes whose parents have all been swept are scheduled onto per-worker
+// deques with work stealing, and adjoints are accumulated atomically. Small
+// graphs (or a NULL pool) are swept on the calling thread.
+void get_gradients_parallel(VariablesGradAllocator *grad_alloc, ThreadPool *pool,
+                            Variable **independent_vars, const nn_real *seeds, int n_vars)
+{
+    if (grad_alloc == NULL || independent_vars == NULL)
+    {
+        return;
+    }
+
+    record_roots(grad_alloc, independent_vars, n_vars);
+    size_t n_order = sort_graph(grad_alloc, independent_vars, n_vars);
+    if (n_order == 0)
+    {
+        return;
+    }
+    seed_adjoints(grad_alloc, n_order, independent_vars, seeds, n_vars);
+    if (pool == NULL || pool->n_threads == 0 || n_order < NN_PARALLEL_MIN_NODES)
+    {
+        sweep_adjoints(grad_alloc, n_order);
+        return;
+    }
+
+    ParallelSweep sweep;
+    sweep.order = grad_alloc->order;
+    sweep.n_workers = pool->n_threads + 1;
+    sweep.first_edge = grad_alloc->first_edge;
+    sweep.edges = grad_alloc->edges;
+    sweep.adjoints = (_Atomic nn_real *)malloc(n_order * sizeof(_Atomic nn_real));
+    sweep.pending = (atomic_size_t *)malloc(n_order * sizeof(atomic_size_t));
+    sweep.deques = (WorkDeque *)calloc(sweep.n_workers, sizeof(WorkDeque));
+    atomic_init(&sweep.remaining, n_order);
+    for (size_t slot = 0; slot < n_order; slot++)
+    {
+        atomic_init(&sweep.adjoints[slot], grad_alloc->adjoints[slot]);
+        atomic_init(&sweep.pending[slot], 0);
+    }
+    for (size_t slot = 0; slot < n_order; slot++)
+    {
+        Variable *var = grad_alloc->order[slot];
+        const size_t *edges = grad_alloc->edges + grad_alloc->first_edge[slot];
+        for (int child_idx = 0; child_idx < var->n_children; child_idx++)
+        {
+            if (edges[child_idx] != SIZE_MAX)
+            {
+                atomic_fetch_add_explicit(&sweep.pending[edges[child_idx]], 1, memory_order_relaxed);
+            }
+        }
+    }
+    for (size_t worker = 0; worker < sweep.n_workers; worker++)
+    {
+        pthread_mutex_init(&sweep.deques[worker].lock, NULL);
+    }
+
+    // nodes without parents start out ready, spread over the workers
+    size_t n_ready = 0;
+    for (size_t slot = n_order; slot-- > 0;)
+    {
+        if (atomic_load_explicit(&sweep.pending[slot], memory_order_relaxed) == 0)
+        {
+            deque_push(&sweep.deques[n_ready++ % sweep.n_workers], slot);
+        }
+    }
+
+    thread_pool_run(pool, parallel_sweep_worker, &sweep);
+
+    for (size_t slot = 0; slot < n_order; slot++)
+    {
+        grad_alloc->adjoints[slot] = atomic_load_explicit(&sweep.adjoints[slot], memory_order_relaxed);
+    }
+    collect_grads(grad_alloc, n_order);
+
+    for (size_t worker = 0; worker < sweep.n_workers; worker++)
+    {
+        pthread_mutex_destroy(&sweep.deques[worker].lock);
+        free(sweep.deques[worker].items);
+    }
+    free(sweep.deques);
+    free(sweep.pending);
+    free(sweep.adjoints);
+}
+
+//// FORWARD MODE /////
+
+// A dual number with the given tangent lanes (NULL: a constant)
+Dual dual_var(nn_real value, const nn_real *tangent)
+{
+    Dual dual;
+    dual.val = value;
+    for (int lane = 0; lane < NN_DUAL_LANES; lane++)
+    {
+        dual.tan[lane] = tangent == NULL ? 0 : tangent[lane];
+    }
+    return dual;
+}
+
+// A dual number seeded with a unit tangent in lane
+Dual dual_seed(nn_real value, int lane)
+{
+    Dual dual = dual_var(value, NULL);
+    dual.tan[lane] = 1;
+    return dual;
+}
+
+// Applies op to x (and y, ignored by unary ops), pushing every tangent lane
+// through the op's local gradients. Nothing is recorded.
+Dual dual_op(NNOp op, Dual x, Dual y, nn_real param)
+{
+    nn_real local_grads[2];
+    Dual res;
+    res.val = eval_op(op, x.val, y.val, param, local_grads);
+    for (int lane = 0; lane < NN_DUAL_LANES; lane++)
+    {
+        res.tan[lane] = local_grads[0] * x.tan[lane] + local_grads[1] * y.tan[lane];
+    }
+    return res;
+}
+
+Dual dual_add(Dual x, Dual y)
+{
+    return dual_op(NN_OP_ADD, x, y, 0);
+}
+
+Dual dual_sub(Dual x, Dual y)
+{
+    return dual_op(NN_OP_SUB, x, y, 0);
+}
+
+Dual dual_mul(Dual x, Dual y)
+{
+    return dual_op(NN_OP_MUL, x, y, 0);
+}
+
+Dual dual_sigmoid(Dual x)
+{
+    return dual_op(NN_OP_SIGMOID, x, x, 0);
+}
+
+Dual dual_relu(Dual x)
+{
+    return dual_op(NN_OP_RELU, x, x, 0);
+}
+
+Dual dual_power(Dual x, nn_real n)
+{
+    return dual_op(NN_OP_POWER, x, x, n);
+}
+
+//// PROGRAM /////
+
+// Capture the graph computing outputs into prog. Leaves listed in inputs can
+// be rebound with program_set_input, every other leaf is frozen as a
+// constant. The graph itself is left untouched and can be freed afterwards.
+// Returns false, leaving prog empty, if the graph contains a checkpoint node:
+// an instruction has room for two operands and cannot replay a region.
+bool program_capture(Program *prog, Variable **inputs, size_t n_inputs,
+                     Variable **outputs, size_t n_outputs)
+{
+    VariablesGradAllocator sorter;
+    init_grad_alloc(&sorter);
+    sorter.keep_constants = true;
+    size_t n_instrs = sort_graph(&sorter, outputs, n_outputs);
+
+    memset(prog, 0, sizeof(Program));
+    for (size_t slot = 0; slot < n_instrs; slot++)
+    {
+        if (sorter.order[slot]->op == NN_OP_CHECKPOINT)
+        {
+            free_grad_alloc(&sorter, 0);
+            return false;
+        }
+    }
+
+    prog->n_instrs = n_instrs;
+    prog->instrs = (ProgramInstr *)malloc(n_instrs * sizeof(ProgramInstr));
+    prog->vals = (nn_real *)malloc(n_instrs * sizeof(nn_real));
+    prog->local_grads = (nn_real *)calloc(2 * n_instrs, sizeof(nn_real));
+    prog->grads = (nn_real *)calloc(n_instrs, sizeof(nn_real));
+
+    for (size_t slot = 0; slot < n_instrs; slot++)
+    {
+        Variable *var = sorter.order[slot];
+        ProgramInstr *instr = &prog->instrs[slot];
+        instr->op = var->n_children == 0 ? NN_OP_LEAF : var->op;
+        instr->args[0] = instr->args[1] = 0;
+        for (int child_idx = 0; child_idx < var->n_children && child_idx < 2; child_idx++)
+        {
+            instr->args[child_idx] = (uint32_t)sorter.edges[sorter.first_edge[slot] + child_idx];
+        }
+        instr->param = var->param;
+        prog->vals[slot] = var->val;
+        for (int child_idx = 0; child_idx < var->n_children; child_idx++)
+        {
+            prog->local_grads[2 * slot + child_idx] = var->local_grads[child_idx];
+        }
+    }
+
+    prog->n_inputs = n_inputs;
+    prog->inputs = (uint32_t *)malloc(n_inputs * sizeof(uint32_t));
+    for (size_t idx = 0; idx < n_inputs; idx++)
+    {
+        size_t slot;
+        prog->inputs[idx] = sorted_slot(&sorter, inputs[idx], &slot) ? (uint32_t)slot : UINT32_MAX;
+    }
+
+    prog->n_outputs = n_outputs;
+    prog->outputs = (uint32_t *)malloc(n_outputs * sizeof(uint32_t));
+    for (size_t idx = 0; idx < n_outputs; idx++)
+    {
+        size_t slot = 0;
+        sorted_slot(&sorter, outputs[idx], &slot);
+        prog->outputs[idx] = (uint32_t)slot;
+    }
+
+    free_grad_alloc(&sorter, 0);
+    return true;
+}
+
+void program_free(Program *prog)
+{
+    free(prog->instrs);
+    free(prog->vals);
+    free(prog->local_grads);
+    free(prog->grads);
+    free(prog->inputs);
+    free(prog->outputs);
+}
+
+// Rebind the value of the idx-th input for the next program_forward
+void program_set_input(Program *prog, size_t idx, nn_real value)
+{
+    if (prog->inputs[idx] != UINT32_MAX)
+    {
+        prog->vals[prog->inputs[idx]] = value;
+    }
+}
+
+// Recompute every value and local gradient from the current inputs
+void program_forward(Program *prog)
+{
+    const ProgramInstr *instrs = prog->instrs;
+    nn_real *vals = prog->vals;
+    for (size_t slot = 0; slot < prog->n_instrs; slot++)
+    {
+        if (instrs[slot].op == NN_OP_LEAF)
+        {
+            continue;
+        }
+        vals[slot] = eval_op(instrs[slot].op, vals[instrs[slot].args[0]], vals[instrs[slot].args[1]],
+                             instrs[slot].param, &prog->local_grads[2 * slot]);
+    }
+}
+
+// Reverse sweep from the outputs, seeded with seeds (NULL: 1 for every output)
+void program_backward(Program *prog, const nn_real *seeds)
+{
+    nn_real *grads = prog->grads;
+    memset(grads, 0, prog->n_instrs * sizeof(nn_real));
+    for (size_t idx = 0; idx < prog->n_outputs; idx++)
+    {
+        grads[prog->outputs[idx]] += seeds == NULL ? 1 : seeds[idx];
+    }
+
+    for (size_t slot = prog->n_instrs; slot-- > 0;)
+    {
+        const ProgramInstr *instr = &prog->instrs[slot];
+        for (int arg = 0; arg < op_arity(instr->op); arg++)
+        {
+            grads[instr->args[arg]] += grads[slot] * prog->local_grads[2 * slot + arg];
+        }
+    }
+}
+
+// Value of the idx-th output after the last program_forward
+nn_real program_output(Program *prog, size_t idx)
+{
+    return prog->vals[prog->outputs[idx]];
+}
+
+// Gradient w.r.t. the idx-th input after the last program_backward
+nn_real program_gradient(Program *prog, size_t idx)
+{
+    return prog->inputs[idx] == UINT32_MAX ? 0 : prog->grads[prog->inputs[idx]];
+}
+
+//// TENSORS /////
+
+// index a tensor: offset of the element at indices in data
+int tensor_index(Tensor *tensor, int *indices)
+{
+    int index = 0;
+    for (int i = 0; i < tensor->shape_size; ++i)
+    {
+        index += tensor->strides[i] * indices[i];
+    }
+    return index;
+}
+
+// Offset under strides of the element with row-major flat index flat in shape
+ptrdiff_t index_offset(size_t flat, const size_t *shape, const int *strides, size_t shape_size)
+{
+    ptrdiff_t offset = 0;
+    for (size_t i = shape_size; i-- > 0;)
+    {
+        offset += (ptrdiff_t)(flat % shape[i]) * strides[i];
+        flat /= shape[i];
+    }
+    return offset;
+}
+
+// Set shape and contiguous row-major strides (last dim fastest)
+void tensor_set_shape(Tensor *tensor, size_t shape_size, const size_t *shape)
+{
+    tensor->shape_size = shape_size;
+    tensor->size = 1;
+    for (size_t i = shape_size; i-- > 0;)
+    {
+        tensor->shape[i] = shape[i];
+        tensor->strides[i] = (int)tensor->size;
+        tensor->size *= shape[i];
+    }
+}
+
+// initializing a zero filled tensor with shape, backed by one contiguous
+// buffer from the bound context's buffer cache. Leaves start without a
+// gradient; set requires_grad to train them. Returns NULL if shape_size
+// exceeds NN_MAX_DIMS.
+Tensor *init_tensor(size_t shape_size, size_t *shape)
+{
+    if (shape_size > NN_MAX_DIMS)
+    {
+        return NULL;
+    }
+    Tensor *tensor = (Tensor *)calloc(1, sizeof(Tensor));
+    tensor_set_shape(tensor, shape_size, shape);
+    tensor->data = (nn_real *)buffer_alloc(&graph_context()->buffers, tensor->size * sizeof(nn_real));
+    tensor->owns_data = true;
+    return tensor;
+}
+
+// Result tensor of an op on children, with backward as its gradient
+// function. The result holds a reference to each child and requires a
+// gradient if any of them does.
+Tensor *new_op_tensor(size_t shape_size, size_t *shape, Tensor **children, int n_children,
+                      void (*backward)(Tensor *))
+{
+    Tensor *tensor = init_tensor(shape_size, shape);
+    tensor->backward = backward;
+    tensor->n_children = n_children;
+    for (int i = 0; i < n_children; i++)
+    {
+        tensor->children[i] = children[i];
+        children[i]->refcount++;
+        tensor->requires_grad |= children[i]->requires_grad;
+    }
+    return tensor;
+}
+
+// Gradient buffer of tensor, allocated zeroed on first use. A view's gradient
+// lives in the storage of the tensor it views, so it lands there directly.
+nn_real *tensor_grad(Tensor *tensor)
+{
+    if (tensor->grad == NULL)
+    {
+        tensor->grad = tensor->is_view ? tensor_grad(tensor->children[0]) + tensor->offset
+                                       : (nn_real *)buffer_alloc(&graph_context()->buffers, tensor->size * sizeof(nn_real));
+    }
+    return tensor->grad;
+}
+
+// Reverse sweep from root, seeded with a gradient of ones: every tensor
+// below root that requires a gradient has its grad reset and then filled in
+// by the backward functions of its parents
+void tensor_backward(Tensor *root)
+{
+    if (root == NULL || !root->requires_grad)
+    {
+        return;
+    }
+
+    // post-order DFS, like topo_sort for scalars
+    uint64_t epoch = next_epoch();
+    size_t order_cap = 16, n_order = 0, stack_cap = 16, depth = 0;
+    Tensor **order = (Tensor **)malloc(order_cap * sizeof(Tensor *));
+    Tensor **stack = (Tensor **)malloc(stack_cap * sizeof(Tensor *));
+    int *next_child = (int *)malloc(stack_cap * sizeof(int));
+    root->mark = epoch;
+    stack[depth] = root;
+    next_child[depth++] = 0;
+    while (depth > 0)
+    {
+        Tensor *tensor = stack[depth - 1];
+        if (next_child[depth - 1] < tensor->n_children)
+        {
+            Tensor *child = tensor->children[next_child[depth - 1]++];
+            if (child->mark == epoch || !child->requires_grad)
+            {
+                continue;
+            }
+            child->mark = epoch;
+            if (depth == stack_cap)
+            {
+                stack_cap *= 2;
+                stack = (Tensor **)realloc(stack, stack_cap * sizeof(Tensor *));
+                next_child = (int *)realloc(next_child, stack_cap * sizeof(int));
+            }
+            stack[depth] = child;
+            next_child[depth++] = 0;
+            continue;
+        }
+        if (n_order == order_cap)
+        {
+            order_cap *= 2;
+            order = (Tensor **)realloc(order, order_cap * sizeof(Tensor *));
+        }
+        order[n_order++] = tensor;
+        depth--;
+    }
+
+    // views are cleared through the tensors they view, which are in order too
+    for (size_t idx = 0; idx < n_order; idx++)
+    {
+        nn_real *grad = tensor_grad(order[idx]);
+        if (!order[idx]->is_view)
+        {
+            memset(grad, 0, order[idx]->size * sizeof(nn_real));
+        }
+    }
+    for (size_t idx = 0; idx < root->size; idx++)
+    {
+        root->grad[index_offset(idx, root->shape, root->strides, root->shape_size)] += 1;
+    }
+    for (size_t idx = n_order; idx-- > 0;)
+    {
+        if (order[idx]->backward != NULL)
+        {
+            order[idx]->backward(order[idx]);
+        }
+    }
+
+    free(next_child);
+    free(stack);
+    free(order);
+}
+
+// Take a reference to tensor, see retain_variable
+void retain_tensor(Tensor *tensor)
+{
+    tensor->refcount++;
+}
+
+// Drop a reference to tensor. Once nothing references it, its buffers go back
+// to the bound context's buffer cache and its references to its children are
+// dropped in turn.
+void release_tensor(Tensor *tensor)
+{
+    if (tensor == NULL || (tensor->refcount > 0 && --tensor->refcount > 0))
+    {
+        return;
+    }
+
+    BufferCache *buffers = &graph_context()->buffers;
+    size_t stack_cap = 16, depth = 0;
+    Tensor **stack = (Tensor **)malloc(stack_cap * sizeof(Tensor *));
+    stack[depth++] = tensor;
+    while (depth > 0)
+    {
+        Tensor *node = stack[--depth];
+        if (depth + node->n_children > stack_cap)
+        {
+            stack_cap = 2 * (depth + node->n_children);
+            stack = (Tensor **)realloc(stack, stack_cap * sizeof(Tensor *));
+        }
+        for (int i = 0; i < node->n_children; i++)
+        {
+            if (--node->children[i]->refcount == 0)
+            {
+                stack[depth++] = node->children[i];
+            }
+        }
+        if (node->owns_data)
+        {
+            buffer_free(buffers, node->data, node->size * sizeof(nn_real));
+        }
+        if (!node->is_view)
+        {
+            buffer_free(buffers, node->grad, node->size * sizeof(nn_real));
+        }
+        free(node->saved);
+        free(node);
+    }
+    free(stack);
+}
+
+// Free tensor and every tensor below it that is not referenced from elsewhere
+void free_tensor(Tensor *tensor)
+{
+    if (tensor != NULL)
+    {
+        retain_tensor(tensor);
+        release_tensor(tensor);
+    }
+}
+
+//// VIEWS /////
+
+// NumPy broadcast of shapes a and b (aligned at the last dim, sizes equal or
+// 1) into shape. Returns false if they are incompatible.
+bool broadcast_shape(const size_t *a, size_t a_size, const size_t *b, size_t b_size,
+                     size_t *shape, size_t *shape_size)
+{
+    size_t n = a_size > b_size ? a_size : b_size;
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t a_dim = i < n - a_size ? 1 : a[i - (n - a_size)];
+        size_t b_dim = i < n - b_size ? 1 : b[i - (n - b_size)];
+        if (a_dim != b_dim && a_dim != 1 && b_dim != 1)
+        {
+            return false;
+        }
+        shape[i] = a_dim == 1 ? b_dim : a_dim;
+    }
+    *shape_size = n;
+    return true;
+}
+
+// Strides that read tensor at a broadcast shape of shape_size dims: 0 along
+// the dims it is broadcast over
+void broadcast_strides(const Tensor *tensor, size_t shape_size, int *strides)
+{
+    size_t lead = shape_size - tensor->shape_size;
+    for (size_t i = 0; i < shape_size; i++)
+    {
+        strides[i] = i < lead || tensor->shape[i - lead] == 1 ? 0 : tensor->strides[i - lead];
+    }
+}
+
+
+// A tensor sharing the storage of a, starting offset elements into a's data
+// and read through shape and strides. Nothing is copied; gradients of the
+// view land in a's gradient storage. Returns NULL if shape_size exceeds
+// NN_MAX_DIMS.
+Tensor *new_view(Tensor *a, size_t shape_size, const size_t *shape, const int *strides, ptrdiff_t offset)
+{
+    if (shape_size > NN_MAX_DIMS)
+    {
+        return NULL;
+    }
+    Tensor *view = (Tensor *)calloc(1, sizeof(Tensor));
+    view->shape_size = shape_size;
+    view->size = 1;
+    for (size_t i = 0; i < shape_size; i++)
+    {
+        view->shape[i] = shape[i];
+        view->strides[i] = strides[i];
+        view->size *= shape[i];
+    }
+    view->data = a->data + offset;
+    view->is_view = true;
+    view->offset = offset;
+    view->children[0] = a;
+    view->n_children = 1;
+    view->requires_grad = a->requires_grad;
+    a->refcount++;
+    return view;
+}
+
+// View of a with its dims reordered: dim i of the view is dim dims[i] of a.
+// Returns NULL if dims is not a permutation of a's dims.
+Tensor *tensor_permute(Tensor *a, const int *dims)
+{
+    size_t shape[NN_MAX_DIMS];
+    int strides[NN_MAX_DIMS];
+    bool seen[NN_MAX_DIMS] = {false};
+    for (size_t i = 0; i < a->shape_size; i++)
+    {
+        if (dims[i] < 0 || dims[i] >= (int)a->shape_size || seen[dims[i]])
+        {
+            return NULL;
+        }
+        seen[dims[i]] = true;
+        shape[i] = a->shape[dims[i]];
+        strides[i] = a->strides[dims[i]];
+    }
+    return new_view(a, a->shape_size, shape, strides, 0);
+}
+
+// View of a with dims dim_0 and dim_1 swapped. Returns NULL if either is not
+// a dim of a.
+Tensor *tensor_transpose(Tensor *a, int dim_0, int dim_1)
+{
+    if (dim_0 < 0 || dim_0 >= (int)a->shape_size || dim_1 < 0 || dim_1 >= (int)a->shape_size)
+    {
+        return NULL;
+    }
+    int dims[NN_MAX_DIMS] = {0};
+    for (int i = 0; i < (int)a->shape_size; i++)
+    {
+        dims[i] = i == dim_0 ? dim_1 : i == dim_1 ? dim_0 : i;
+    }
+    return tensor_permute(a, dims);
+}
+
+// true if a is laid out row-major without gaps
+bool tensor_is_contiguous(const Tensor *a)
+{
+    size_t expected = 1;
+    for (size_t i = a->shape_size; i-- > 0;)
+    {
+        if (a->shape[i] != 1 && a->strides[i] != (int)expected)
+        {
+            return false;
+        }
+        expected *= a->shape[i];
+    }
+    return true;
+}
+
+// View of contiguous a with a new shape of the same size. Returns NULL if a is
+// not contiguous (a strided view would need a copy), the sizes differ or
+// shape_size exceeds NN_MAX_DIMS.
+Tensor *tensor_reshape(Tensor *a, size_t shape_size, const size_t *shape)
+{
+    if (shape_size > NN_MAX_DIMS)
+    {
+        return NULL;
+    }
+    Tensor layout;
+    tensor_set_shape(&layout, shape_size, shape);
+    if (!tensor_is_contiguous(a) || layout.size != a->size)
+    {
+        return NULL;
+    }
+    return new_view(a, shape_size, layout.shape, layout.strides, 0);
+}
+
+// View of the elements start, start + step, ... before stop along dim (stop
+// is clamped to the dim's size). Returns NULL if dim is not a dim of a or
+// step is 0.
+Tensor *tensor_slice(Tensor *a, int dim, size_t start, size_t stop, size_t step)
+{
+    if (dim < 0 || dim >= (int)a->shape_size || step == 0)
+    {
+        return NULL;
+    }
+    if (stop > a->shape[dim])
+    {
+        stop = a->shape[dim];
+    }
+    if (start > stop)
+    {
+        start = stop;
+    }
+    size_t shape[NN_MAX_DIMS];
+    int strides[NN_MAX_DIMS];
+    memcpy(shape, a->shape, a->shape_size * sizeof(size_t));
+    memcpy(strides, a->strides, a->shape_size * sizeof(int));
+    shape[dim] = (stop - start + step - 1) / step;
+    strides[dim] = a->strides[dim] * (int)step;
+    return new_view(a, a->shape_size, shape, strides, (ptrdiff_t)start * a->strides[dim]);
+}
+
+// View of a broadcast to shape: dims of size 1 and missing leading dims are
+// repeated through stride 0. Returns NULL if a does not broadcast to shape or
+// shape_size exceeds NN_MAX_DIMS.
+Tensor *tensor_expand(Tensor *a, size_t shape_size, const size_t *shape)
+{
+    if (shape_size < a->shape_size || shape_size > NN_MAX_DIMS)
+    {
+        return NULL;
+    }
+    size_t lead = shape_size - a->shape_size;
+    for (size_t i = lead; i < shape_size; i++)
+    {
+        if (a->shape[i - lead] != shape[i] && a->shape[i - lead] != 1)
+        {
+            return NULL;
+        }
+    }
+    int strides[NN_MAX_DIMS];
+    broadcast_strides(a, shape_size, strides);
+    return new_view(a, shape_size, shape, strides, 0);
+}
+
+//// TENSOR OPS /////
+
+// MR x NR tile of C += packed A micro-panel (kc x MR) * packed B micro-panel
+// (kc x NR). The accumulators stay in vector registers, only the mr x nr
+// corner that exists in C is written back.
+void gemm_kernel(size_t kc, const nn_real *a, const nn_real *b,
+                 nn_real *c, ptrdiff_t c_rs, ptrdiff_t c_cs, size_t mr, size_t nr)
+{
+    GemmVec acc[NN_GEMM_MR][2];
+    for (int i = 0; i < NN_GEMM_MR; i++)
+    {
+        acc[i][0] = acc[i][1] = (GemmVec){0};
+    }
+    for (size_t p = 0; p < kc; p++)
+    {
+        const GemmVec *b_row = (const GemmVec *)(b + p * NN_GEMM_NR);
+        GemmVec b_0 = b_row[0], b_1 = b_row[1];
+        for (int i = 0; i < NN_GEMM_MR; i++)
+        {
+            nn_real a_i = a[p * NN_GEMM_MR + i];
+            acc[i][0] += a_i * b_0;
+            acc[i][1] += a_i * b_1;
+        }
+    }
+
+    // spill the tile once, so the accumulators stay in registers above
+    GemmVec tile[NN_GEMM_MR][2];
+    for (int i = 0; i < NN_GEMM_MR; i++)
+    {
+        tile[i][0] = acc[i][0];
+        tile[i][1] = acc[i][1];
+    }
+    const nn_real *t = (const nn_real *)tile;
+    for (size_t i = 0; i < mr; i++)
+    {
+        for (size_t j = 0; j < nr; j++)
+        {
+            c[i * c_rs + j * c_cs] += t[i * NN_GEMM_NR + j];
+        }
+    }
+}
+
+// C (m x n) = A (m x k) * B (k x n), or C += A * B if accumulate is set.
+// Every matrix is given by its row and column stride, so transposes and
+// strided views need no copy. Blocked for the caches as in BLIS: panels of B
+// and blocks of A are packed into contiguous, zero padded micro-panels that
+// gemm_kernel streams through.
+void gemm(size_t m, size_t n, size_t k,
+          const nn_real *a, ptrdiff_t a_rs, ptrdiff_t a_cs,
+          const nn_real *b, ptrdiff_t b_rs, ptrdiff_t b_cs,
+          nn_real *c, ptrdiff_t c_rs, ptrdiff_t c_cs, bool accumulate)
+{
+    if (!accumulate)
+    {
+        for (size_t i = 0; i < m; i++)
+        {
+            for (size_t j = 0; j < n; j++)
+            {
+                c[i * c_rs + j * c_cs] = 0;
+            }
+        }
+    }
+    if (m == 0 || n == 0 || k == 0)
+    {
+        return;
+    }
+
+    // packs hold the largest blocks this product uses, whole micro-panels
+    // each, and come from the context's buffer cache so repeated calls (e.g.
+    // once per image in conv2d) do not go to the heap
+    size_t kc_max = k < NN_GEMM_KC ? k : NN_GEMM_KC;
+    size_t mc_max = m < NN_GEMM_MC ? m : NN_GEMM_MC;
+    size_t nc_max = n < NN_GEMM_NC ? n : NN_GEMM_NC;
+    size_t a_bytes = (mc_max + NN_GEMM_MR - 1) / NN_GEMM_MR * NN_GEMM_MR * kc_max * sizeof(nn_real);
+    size_t b_bytes = (nc_max + NN_GEMM_NR - 1) / NN_GEMM_NR * NN_GEMM_NR * kc_max * sizeof(nn_real);
+    BufferCache *buffers = &graph_context()->buffers;
+    nn_real *a_pack = (nn_real *)buffer_alloc(buffers, a_bytes);
+    nn_real *b_pack = (nn_real *)buffer_alloc(buffers, b_bytes);
+
+    for (size_t jc = 0; jc < n; jc += NN_GEMM_NC)
+    {
+        size_t nc = n - jc < NN_GEMM_NC ? n - jc : NN_GEMM_NC;
+        for (size_t pc = 0; pc < k; pc += NN_GEMM_KC)
+        {
+            size_t kc = k - pc < NN_GEMM_KC ? k - pc : NN_GEMM_KC;
+
+            // B[pc:pc+kc, jc:jc+nc] as kc x NR micro-panels
+            for (size_t jr = 0; jr < nc; jr += NN_GEMM_NR)
+            {
+                nn_real *panel = b_pack + jr * kc;
+                const nn_real *src = b + pc * b_rs + (jc + jr) * b_cs;
+                size_t nr = nc - jr < NN_GEMM_NR ? nc - jr : NN_GEMM_NR;
+                for (size_t p = 0; p < kc; p++)
+                {
+                    for (size_t j = 0; j < NN_GEMM_NR; j++)
+                    {
+                        panel[p * NN_GEMM_NR + j] = j < nr ? src[p * b_rs + j * b_cs] : 0;
+                    }
+                }
+            }
+
+            for (size_t ic = 0; ic < m; ic += NN_GEMM_MC)
+            {
+                size_t mc = m - ic < NN_GEMM_MC ? m - ic : NN_GEMM_MC;
+
+                // A[ic:ic+mc, pc:pc+kc] as kc x MR micro-panels
+                for (size_t ir = 0; ir < mc; ir += NN_GEMM_MR)
+                {
+                    nn_real *panel = a_pack + ir * kc;
+                    const nn_real *src = a + (ic + ir) * a_rs + pc * a_cs;
+                    size_t mr = mc - ir < NN_GEMM_MR ? mc - ir : NN_GEMM_MR;
+                    for (size_t p = 0; p < kc; p++)
+                    {
+                        for (size_t i = 0; i < NN_GEMM_MR; i++)
+                        {
+                            panel[p * NN_GEMM_MR + i] = i < mr ? src[i * a_rs + p * a_cs] : 0;
+                        }
+                    }
+                }
+
+                for (size_t jr = 0; jr < nc; jr += NN_GEMM_NR)
+                {
+                    size_t nr = nc - jr < NN_GEMM_NR ? nc - jr : NN_GEMM_NR;
+                    for (size_t ir = 0; ir < mc; ir += NN_GEMM_MR)
+                    {
+                        size_t mr = mc - ir < NN_GEMM_MR ? mc - ir : NN_GEMM_MR;
+                        gemm_kernel(kc, a_pack + ir * kc, b_pack + jr * kc,
+                                    c + (ic + ir) * c_rs + (jc + jr) * c_cs, c_rs, c_cs, mr, nr);
+                    }
+                }
+            }
+        }
+    }
+
+    buffer_free(buffers, b_pack, b_bytes);
+    buffer_free(buffers, a_pack, a_bytes);
+}
+
+// Offset under strides of row number row, counting rows over all but the last
+// dim of shape
+ptrdiff_t row_offset(const size_t *shape, size_t shape_size, const int *strides, size_t row)
+{
+    ptrdiff_t offset = 0;
+    for (size_t i = shape_size; i > 1; i--)
+    {
+        offset += (ptrdiff_t)(row % shape[i - 2]) * strides[i - 2];
+        row /= shape[i - 2];
+    }
+    return offset;
+}
+
+// n elements starting at data, stride apart, as a contiguous row: data itself
+// if the stride is 1, otherwise a copy in buf
+const nn_real *gather_row(const nn_real *data, int stride, size_t n, nn_real *buf)
+{
+    if (stride == 1)
+    {
+        return data;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        buf[i] = data[i * stride];
+    }
+    return buf;
+}
+
+// out[i] = op(x[i], y[i]) over contiguous rows, one tight loop per op so the
+// compiler can vectorize it
+void elementwise_kernel(NNOp op, size_t n, const nn_real *x, const nn_real *y,
+                        nn_real param, nn_real *out)
+{
+    switch (op)
+    {
+    case NN_OP_ADD:
+        for (size_t i = 0; i < n; i++)
+        {
+            out[i] = x[i] + y[i];
+        }
+        break;
+    case NN_OP_SUB:
+        for (size_t i = 0; i < n; i++)
+        {
+            out[i] = x[i] - y[i];
+        }
+        break;
+    case NN_OP_MUL:
+        for (size_t i = 0; i < n; i++)
+        {
+            out[i] = x[i] * y[i];
+        }
+        break;
+    case NN_OP_SIGMOID:
+        for (size_t i = 0; i < n; i++)
+        {
+            out[i] = 1 / (1 + exp(-x[i]));
+        }
+        break;
+    case NN_OP_RELU:
+        for (size_t i = 0; i < n; i++)
+        {
+            out[i] = x[i] > 0 ? x[i] : 0;
+        }
+        break;
+    case NN_OP_POWER:
+        for (size_t i = 0; i < n; i++)
+        {
+            out[i] = pow(x[i], param);
+        }
+        break;
+    default:
+        memcpy(out, x, n * sizeof(nn_real));
+        break;
+    }
+}
+
+// d[i] = g[i] * d op(x[i], y[i]) / d operand, where out holds the op's values
+void elementwise_grad_kernel(NNOp op, int operand, size_t n, const nn_real *g, const nn_real *x,
+                             const nn_real *y, const nn_real *out, nn_real param, nn_real *d)
+{
+    switch (op)
+    {
+    case NN_OP_SUB:
+        for (size_t i = 0; i < n; i++)
+        {
+            d[i] = operand == 0 ? g[i] : -g[i];
+        }
+        break;
+    case NN_OP_MUL:
+    {
+        const nn_real *other = operand == 0 ? y : x;
+        for (size_t i = 0; i < n; i++)
+        {
+            d[i] = g[i] * other[i];
+        }
+        break;
+    }
+    case NN_OP_SIGMOID:
+        for (size_t i = 0; i < n; i++)
+        {
+            d[i] = g[i] * out[i] * (1 - out[i]);
+        }
+        break;
+    case NN_OP_RELU:
+        for (size_t i = 0; i < n; i++)
+        {
+            d[i] = x[i] < 0 ? 0 : g[i]; // relu'(0) = 1, as in eval_op
+        }
+        break;
+    case NN_OP_POWER:
+        for (size_t i = 0; i < n; i++)
+        {
+            d[i] = g[i] * param * pow(x[i], param - 1);
+        }
+        break;
+    default:
+        memcpy(d, g, n * sizeof(nn_real));
+        break;
+    }
+}
+
+// Pushes the gradient of an element-wise op to its operands. Along broadcast
+// dims an operand's stride is 0, so the gradient rows are summed into it.
+void elementwise_backward(Tensor *out)
+{
+    size_t nd = out->shape_size;
+    size_t inner = nd == 0 ? 1 : out->shape[nd - 1];
+    size_t rows = inner == 0 ? 0 : out->size / inner;
+    int strides[2][NN_MAX_DIMS];
+    for (int c = 0; c < out->n_children; c++)
+    {
+        broadcast_strides(out->children[c], nd, strides[c]);
+    }
+    nn_real *bufs = (nn_real *)malloc(3 * (inner + 1) * sizeof(nn_real));
+    nn_real *x_buf = bufs, *y_buf = bufs + inner + 1, *d = bufs + 2 * (inner + 1);
+
+    for (size_t row = 0; row < rows; row++)
+    {
+        const nn_real *g = out->grad + row * inner;
+        const nn_real *vals = out->data + row * inner;
+        Tensor *a = out->children[0];
+        int a_stride = nd == 0 ? 1 : strides[0][nd - 1];
+        const nn_real *x = gather_row(a->data + row_offset(out->shape, nd, strides[0], row), a_stride, inner, x_buf);
+        const nn_real *y = x;
+        if (out->n_children > 1)
+        {
+            Tensor *b = out->children[1];
+            int b_stride = nd == 0 ? 1 : strides[1][nd - 1];
+            y = gather_row(b->data + row_offset(out->shape, nd, strides[1], row), b_stride, inner, y_buf);
+        }
+
+        for (int c = 0; c < out->n_children; c++)
+        {
+            Tensor *child = out->children[c];
+            if (!child->requires_grad)
+            {
+                continue;
+            }
+            elementwise_grad_kernel(out->op, c, inner, g, x, y, vals, out->param, d);
+
+            nn_real *dst = tensor_grad(child) + row_offset(out->shape, nd, strides[c], row);
+            int stride = nd == 0 ? 1 : strides[c][nd - 1];
+            if (stride == 0)
+            {
+                nn_real sum = 0;
+                for (size_t i = 0; i < inner; i++)
+                {
+                    sum += d[i];
+                }
+                dst[0] += sum;
+            }
+            else
+            {
+                for (size_t i = 0; i < inner; i++)
+                {
+                    dst[i * stride] += d[i];
+                }
+            }
+        }
+    }
+    free(bufs);
+}
+
+// Element-wise op on a (and b for binary ops, ignored otherwise) with NumPy
+// broadcasting, as one tensor node. Returns NULL if an operand the op reads
+// is NULL or the shapes do not broadcast.
+Tensor *tensor_elementwise(NNOp op, Tensor *a, Tensor *b, nn_real param)
+{
+    if (op_arity(op) != 2)
+    {
+        b = NULL;
+    }
+    else if (b == NULL)
+    {
+        return NULL;
+    }
+    if (a == NULL)
+    {
+        return NULL;
+    }
+
+    size_t shape[NN_MAX_DIMS];
+    size_t nd = a->shape_size;
+    memcpy(shape, a->shape, nd * sizeof(size_t));
+    if (b != NULL && !broadcast_shape(a->shape, a->shape_size, b->shape, b->shape_size, shape, &nd))
+    {
+        return NULL;
+    }
+
+    Tensor *children[2] = {a, b};
+    Tensor *out = new_op_tensor(nd, shape, children, b == NULL ? 1 : 2, elementwise_backward);
+    out->op = op;
+    out->param = param;
+
+    size_t inner = nd == 0 ? 1 : shape[nd - 1];
+    size_t rows = inner == 0 ? 0 : out->size / inner;
+    int strides[2][NN_MAX_DIMS];
+    for (int c = 0; c < out->n_children; c++)
+    {
+        broadcast_strides(out->children[c], nd, strides[c]);
+    }
+    nn_real *bufs = (nn_real *)malloc(2 * (inner + 1) * sizeof(nn_real));
+
+    for (size_t row = 0; row < rows; row++)
+    {
+        int a_stride = nd == 0 ? 1 : strides[0][nd - 1];
+        const nn_real *x = gather_row(a->data + row_offset(shape, nd, strides[0], row), a_stride, inner, bufs);
+        const nn_real *y = x;
+        if (b != NULL)
+        {
+            int b_stride = nd == 0 ? 1 : strides[1][nd - 1];
+            y = gather_row(b->data + row_offset(shape, nd, strides[1], row), b_stride, inner, bufs + inner + 1);
+        }
+        elementwise_kernel(op, inner, x, y, param, out->data + row * inner);
+    }
+    free(bufs);
+    return out;
+}
+
+Tensor *tensor_add(Tensor *a, Tensor *b)
+{
+    return tensor_elementwise(NN_OP_ADD, a, b, 0);
+}
+
+Tensor *tensor_sub(Tensor *a, Tensor *b)
+{
+    return tensor_elementwise(NN_OP_SUB, a, b, 0);
+}
+
+Tensor *tensor_mul(Tensor *a, Tensor *b)
+{
+    return tensor_elementwise(NN_OP_MUL, a, b, 0);
+}
+
+Tensor *tensor_sigmoid(Tensor *a)
+{
+    return tensor_elementwise(NN_OP_SIGMOID, a, NULL, 0);
+}
+
+Tensor *tensor_relu(Tensor *a)
+{
+    return tensor_elementwise(NN_OP_RELU, a, NULL, 0);
+}
+
+Tensor *tensor_power(Tensor *a, nn_real n)
+{
+    return tensor_elementwise(NN_OP_POWER, a, NULL, n);
+}
+
+// Sum of n contiguous values by pairwise summation: blocks are added in 8
+// independent lanes (a loop the compiler vectorizes) and halves combined
+// recursively, so rounding error grows with log n instead of n
+nn_real pairwise_sum(const nn_real *x, size_t n)
+{
+    if (n <= 128)
+    {
+        nn_real acc[8] = {0};
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            for (int lane = 0; lane < 8; lane++)
+            {
+                acc[lane] += x[i + lane];
+            }
+        }
+        nn_real sum = 0;
+        for (; i < n; i++)
+        {
+            sum += x[i];
+        }
+        return sum + ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+    }
+    size_t half = n / 2 - n / 2 % 8;
+    return pairwise_sum(x, half) + pairwise_sum(x + half, n - half);
 }
 
-//// TENSOR OPS /////
-// TODO: write tensor ops
+// Plan the reduction of a over axes (all axes if n_axes is 0) into a
+// Reduction allocated together with its offset arrays, and the output shape.
+// Returns NULL if an axis is out of range.
+Reduction *plan_reduction(Tensor *a, const int *axes, size_t n_axes, bool keep_dims,
+                          size_t *shape, size_t *shape_size)
+{
+    bool reduced[NN_MAX_DIMS] = {false};
+    for (size_t i = 0; i < a->shape_size; i++)
+    {
+        reduced[i] = n_axes == 0;
+    }
+    for (size_t i = 0; i < n_axes; i++)
+    {
+        if (axes[i] < 0 || axes[i] >= (int)a->shape_size)
+        {
+            return NULL;
+        }
+        reduced[axes[i]] = true;
+    }
+
+    size_t red_shape[NN_MAX_DIMS], n_red_dims = 0, n_red = 1, n_out = 1;
+    int red_strides[NN_MAX_DIMS];
+    Reduction plan = {0};
+    *shape_size = 0;
+    for (size_t i = 0; i < a->shape_size; i++)
+    {
+        if (reduced[i])
+        {
+            red_shape[n_red_dims] = a->shape[i];
+            red_strides[n_red_dims++] = a->strides[i];
+            n_red *= a->shape[i];
+        }
+        else
+        {
+            plan.kept_shape[plan.n_kept] = a->shape[i];
+            plan.kept_strides[plan.n_kept++] = a->strides[i];
+            n_out *= a->shape[i];
+        }
+        if (!reduced[i] || keep_dims)
+        {
+            shape[(*shape_size)++] = reduced[i] ? 1 : a->shape[i];
+        }
+    }
+    plan.n_out = n_out;
+    plan.n_red = n_red;
+
+    Reduction *out = (Reduction *)malloc(sizeof(Reduction) + (n_red + n_out) * sizeof(ptrdiff_t));
+    *out = plan;
+    out->red_offsets = (ptrdiff_t *)(out + 1);
+    out->picked = out->red_offsets + n_red;
+    out->contiguous = true;
+    for (size_t r = 0; r < n_red; r++)
+    {
+        out->red_offsets[r] = index_offset(r, red_shape, red_strides, n_red_dims);
+        out->contiguous &= out->red_offsets[r] == (ptrdiff_t)r;
+    }
+    return out;
+}
+
+// The elements of a reduced into output element o, contiguous: in place if
+// they already are, otherwise gathered into buf
+const nn_real *reduction_row(const Reduction *plan, const Tensor *a, size_t o, nn_real *buf)
+{
+    const nn_real *base = a->data + index_offset(o, plan->kept_shape, plan->kept_strides, plan->n_kept);
+    if (plan->contiguous)
+    {
+        return base;
+    }
+    for (size_t r = 0; r < plan->n_red; r++)
+    {
+        buf[r] = base[plan->red_offsets[r]];
+    }
+    return buf;
+}
+
+// Spreads the output gradient, scaled by param (1 for sum, 1/n for mean),
+// back over the reduced elements
+void sum_backward(Tensor *out)
+{
+    Tensor *a = out->children[0];
+    const Reduction *plan = (const Reduction *)out->saved;
+    nn_real *grad = tensor_grad(a);
+    for (size_t o = 0; o < plan->n_out; o++)
+    {
+        nn_real *base = grad + index_offset(o, plan->kept_shape, plan->kept_strides, plan->n_kept);
+        nn_real g = out->grad[o] * out->param;
+        for (size_t r = 0; r < plan->n_red; r++)
+        {
+            base[plan->red_offsets[r]] += g;
+        }
+    }
+}
+
+// Routes the output gradient to the maximum of each reduced group
+void max_backward(Tensor *out)
+{
+    Tensor *a = out->children[0];
+    const Reduction *plan = (const Reduction *)out->saved;
+    nn_real *grad = tensor_grad(a);
+    for (size_t o = 0; o < plan->n_out; o++)
+    {
+        grad[plan->picked[o]] += out->grad[o];
+    }
+}
+
+// Sum, mean (mean set) or max (max set) of a over axes (all axes if n_axes is
+// 0). Reduced dims are dropped, or kept with size 1 if keep_dims is set.
+// Returns NULL if an axis is out of range, or for a mean or max over groups
+// with no elements (a sum over them is 0).
+Tensor *tensor_reduce(Tensor *a, const int *axes, size_t n_axes, bool keep_dims, bool mean, bool max)
+{
+    size_t shape[NN_MAX_DIMS], shape_size;
+    Reduction *plan = plan_reduction(a, axes, n_axes, keep_dims, shape, &shape_size);
+    if (plan == NULL || (plan->n_red == 0 && (mean || max)))
+    {
+        free(plan);
+        return NULL;
+    }
+
+    Tensor *out = new_op_tensor(shape_size, shape, &a, 1, max ? max_backward : sum_backward);
+    out->saved = plan;
+    out->param = mean ? (nn_real)1 / plan->n_red : 1;
+    nn_real *buf = (nn_real *)malloc((plan->n_red + 1) * sizeof(nn_real));
+    for (size_t o = 0; o < plan->n_out; o++)
+    {
+        const nn_real *row = reduction_row(plan, a, o, buf);
+        if (!max)
+        {
+            out->data[o] = pairwise_sum(row, plan->n_red) * out->param;
+            continue;
+        }
+
+        size_t best = 0;
+        for (size_t r = 1; r < plan->n_red; r++)
+        {
+            if (row[r] > row[best])
+            {
+                best = r;
+            }
+        }
+        out->data[o] = row[best];
+        plan->picked[o] = index_offset(o, plan->kept_shape, plan->kept_strides, plan->n_kept) +
+                          plan->red_offsets[best];
+    }
+    free(buf);
+    return out;
+}
+
+Tensor *tensor_sum(Tensor *a, const int *axes, size_t n_axes, bool keep_dims)
+{
+    return tensor_reduce(a, axes, n_axes, keep_dims, false, false);
+}
+
+Tensor *tensor_mean(Tensor *a, const int *axes, size_t n_axes, bool keep_dims)
+{
+    return tensor_reduce(a, axes, n_axes, keep_dims, true, false);
+}
+
+Tensor *tensor_max(Tensor *a, const int *axes, size_t n_axes, bool keep_dims)
+{
+    return tensor_reduce(a, axes, n_axes, keep_dims, false, true);
+}
+
+// Index of the maximum of each group reduced by tensor_max, as a flat
+// row-major index over the reduced dims. Not differentiable, so the result is
+// a leaf. Returns NULL like tensor_max.
+Tensor *tensor_argmax(Tensor *a, const int *axes, size_t n_axes, bool keep_dims)
+{
+    size_t shape[NN_MAX_DIMS], shape_size;
+    Reduction *plan = plan_reduction(a, axes, n_axes, keep_dims, shape, &shape_size);
+    if (plan == NULL || plan->n_red == 0)
+    {
+        free(plan);
+        return NULL;
+    }
+
+    Tensor *out = init_tensor(shape_size, shape);
+    nn_real *buf = (nn_real *)malloc((plan->n_red + 1) * sizeof(nn_real));
+    for (size_t o = 0; o < plan->n_out; o++)
+    {
+        const nn_real *row = reduction_row(plan, a, o, buf);
+        size_t best = 0;
+        for (size_t r = 1; r < plan->n_red; r++)
+        {
+            if (row[r] > row[best])
+            {
+                best = r;
+            }
+        }
+        out->data[o] = (nn_real)best;
+    }
+    free(buf);
+    free(plan);
+    return out;
+}
+
+// Leaf of a lazy expression reading tensor
+TensorExpr *expr_tensor(Tensor *tensor)
+{
+    TensorExpr *expr = (TensorExpr *)calloc(1, sizeof(TensorExpr));
+    expr->op = NN_OP_LEAF;
+    expr->tensor = tensor;
+    expr->shape_size = tensor->shape_size;
+    memcpy(expr->shape, tensor->shape, tensor->shape_size * sizeof(size_t));
+    return expr;
+}
+
+// Lazy element-wise op on x (and y for binary ops, ignored otherwise).
+// Returns NULL if an operand the op reads is NULL, e.g. a subexpression that
+// failed to broadcast, or if the shapes do not broadcast.
+TensorExpr *expr_op(NNOp op, TensorExpr *x, TensorExpr *y, nn_real param)
+{
+    bool binary = op_arity(op) == 2;
+    if (x == NULL || (binary && y == NULL))
+    {
+        return NULL;
+    }
+
+    TensorExpr *expr = (TensorExpr *)calloc(1, sizeof(TensorExpr));
+    expr->op = op;
+    expr->args[0] = x;
+    expr->args[1] = binary ? y : NULL;
+    expr->param = param;
+    expr->shape_size = x->shape_size;
+    memcpy(expr->shape, x->shape, x->shape_size * sizeof(size_t));
+    if (binary && !broadcast_shape(x->shape, x->shape_size, y->shape, y->shape_size,
+                                   expr->shape, &expr->shape_size))
+    {
+        free(expr);
+        return NULL;
+    }
+    return expr;
+}
+
+TensorExpr *expr_add(TensorExpr *x, TensorExpr *y)
+{
+    return expr_op(NN_OP_ADD, x, y, 0);
+}
+
+TensorExpr *expr_sub(TensorExpr *x, TensorExpr *y)
+{
+    return expr_op(NN_OP_SUB, x, y, 0);
+}
+
+TensorExpr *expr_mul(TensorExpr *x, TensorExpr *y)
+{
+    return expr_op(NN_OP_MUL, x, y, 0);
+}
+
+TensorExpr *expr_sigmoid(TensorExpr *x)
+{
+    return expr_op(NN_OP_SIGMOID, x, NULL, 0);
+}
+
+TensorExpr *expr_relu(TensorExpr *x)
+{
+    return expr_op(NN_OP_RELU, x, NULL, 0);
+}
+
+TensorExpr *expr_power(TensorExpr *x, nn_real n)
+{
+    return expr_op(NN_OP_POWER, x, NULL, n);
+}
+
+// Appends the instructions computing expr (post-order, shared subexpressions
+// once) to kernel and the distinct input tensors to inputs, and records every
+// distinct node in nodes. Returns the instruction of expr.
+uint32_t fuse_expr(TensorExpr *expr, uint64_t epoch, FusedKernel *kernel, size_t *cap,
+                   Tensor **inputs, int *n_inputs, TensorExpr ***nodes)
+{
+    if (expr->mark == epoch)
+    {
+        return expr->slot;
+    }
+
+    ProgramInstr instr = {expr->op, {0, 0}, expr->param};
+    if (expr->op == NN_OP_LEAF)
+    {
+        int input = 0;
+        while (input < *n_inputs && inputs[input] != expr->tensor)
+        {
+            input++;
+        }
+        if (input == *n_inputs && input < NN_TENSOR_MAX_CHILDREN)
+        {
+            inputs[(*n_inputs)++] = expr->tensor;
+        }
+        instr.args[0] = (uint32_t)input;
+    }
+    else
+    {
+        instr.args[0] = fuse_expr(expr->args[0], epoch, kernel, cap, inputs, n_inputs, nodes);
+        instr.args[1] = op_arity(expr->op) == 2
+                            ? fuse_expr(expr->args[1], epoch, kernel, cap, inputs, n_inputs, nodes)
+                            : instr.args[0];
+    }
+
+    if (kernel->n_instrs == *cap)
+    {
+        *cap = *cap == 0 ? 16 : *cap * 2;
+        kernel->instrs = (ProgramInstr *)realloc(kernel->instrs, *cap * sizeof(ProgramInstr));
+        *nodes = (TensorExpr **)realloc(*nodes, *cap * sizeof(TensorExpr *));
+    }
+    (*nodes)[kernel->n_instrs] = expr;
+    kernel->instrs[kernel->n_instrs] = instr;
+    expr->mark = epoch;
+    expr->slot = (uint32_t)kernel->n_instrs++;
+    return expr->slot;
+}
+
+// Values of every instruction of kernel on one block of n output elements
+// starting at start within row row of out. Loads read their input in place
+// when it is contiguous there, otherwise into their register block.
+void fused_block(const FusedKernel *kernel, Tensor *out, int strides[][NN_MAX_DIMS], size_t row,
+                 size_t start, size_t n, nn_real *regs, const nn_real **vals)
+{
+    size_t nd = out->shape_size;
+    for (size_t i = 0; i < kernel->n_instrs; i++)
+    {
+        const ProgramInstr *instr = &kernel->instrs[i];
+        nn_real *reg = regs + i * NN_FUSE_BLOCK;
+        if (instr->op == NN_OP_LEAF)
+        {
+            const int *input_strides = strides[instr->args[0]];
+            int stride = nd == 0 ? 1 : input_strides[nd - 1];
+            const nn_real *base = out->children[instr->args[0]]->data + row_offset(out->shape, nd, input_strides, row);
+            vals[i] = gather_row(base + (ptrdiff_t)start * stride, stride, n, reg);
+            continue;
+        }
+        elementwise_kernel(instr->op, n, vals[instr->args[0]], vals[instr->args[1]], instr->param, reg);
+        vals[i] = reg;
+    }
+}
+
+// Fused backward: recomputes each block's intermediate values, sweeps the
+// instructions in reverse and adds the adjoints of the loads to the inputs
+void fused_backward(Tensor *out)
+{
+    const FusedKernel *kernel = (const FusedKernel *)out->saved;
+    size_t n_instrs = kernel->n_instrs;
+    size_t nd = out->shape_size;
+    size_t inner = nd == 0 ? 1 : out->shape[nd - 1];
+    size_t rows = inner == 0 ? 0 : out->size / inner;
+    int strides[NN_TENSOR_MAX_CHILDREN][NN_MAX_DIMS];
+    for (int c = 0; c < out->n_children; c++)
+    {
+        broadcast_strides(out->children[c], nd, strides[c]);
+    }
+    nn_real *regs = (nn_real *)malloc((2 * n_instrs + 1) * NN_FUSE_BLOCK * sizeof(nn_real));
+    nn_real *adjoints = regs + n_instrs * NN_FUSE_BLOCK;
+    nn_real *d = adjoints + n_instrs * NN_FUSE_BLOCK;
+    const nn_real **vals = (const nn_real **)malloc(n_instrs * sizeof(nn_real *));
+
+    for (size_t row = 0; row < rows; row++)
+    {
+        for (size_t start = 0; start < inner; start += NN_FUSE_BLOCK)
+        {
+            size_t n = inner - start < NN_FUSE_BLOCK ? inner - start : NN_FUSE_BLOCK;
+            fused_block(kernel, out, strides, row, start, n, regs, vals);
+            memset(adjoints, 0, n_instrs * NN_FUSE_BLOCK * sizeof(nn_real));
+            memcpy(adjoints + (n_instrs - 1) * NN_FUSE_BLOCK, out->grad + row * inner + start, n * sizeof(nn_real));
+
+            for (size_t i = n_instrs; i-- > 0;)
+            {
+                const ProgramInstr *instr = &kernel->instrs[i];
+                nn_real *adjoint = adjoints + i * NN_FUSE_BLOCK;
+                if (instr->op != NN_OP_LEAF)
+                {
+                    for (int operand = 0; operand < op_arity(instr->op); operand++)
+                    {
+                        elementwise_grad_kernel(instr->op, operand, n, adjoint, vals[instr->args[0]],
+                                                vals[instr->args[1]], vals[i], instr->param, d);
+                        nn_real *dst = adjoints + instr->args[operand] * NN_FUSE_BLOCK;
+                        for (size_t j = 0; j < n; j++)
+                        {
+                            dst[j] += d[j];
+                        }
+                    }
+                    continue;
+                }
+
+                Tensor *input = out->children[instr->args[0]];
+                if (!input->requires_grad)
+                {
+                    continue;
+                }
+                const int *input_strides = strides[instr->args[0]];
+                int stride = nd == 0 ? 1 : input_strides[nd - 1];
+                nn_real *dst = tensor_grad(input) + row_offset(out->shape, nd, input_strides, row) + (ptrdiff_t)start * stride;
+                for (size_t j = 0; j < n; j++)
+                {
+                    dst[j * stride] += adjoint[j];
+                }
+            }
+        }
+    }
+    free(vals);
+    free(regs);
+}
+
+// Evaluate a lazy expression as one tensor op: the tree is compiled into a
+// FusedKernel and run block by block over the output, so intermediate values
+// only ever live in a few cache-resident blocks. Backward recomputes them the
+// same way. The expression nodes are consumed. Returns NULL if expr is NULL
+// or reads more than NN_TENSOR_MAX_CHILDREN distinct tensors.
+Tensor *tensor_eval(TensorExpr *expr)
+{
+    if (expr == NULL)
+    {
+        return NULL;
+    }
+
+    size_t cap = 0;
+    FusedKernel kernel = {0, NULL};
+    TensorExpr **nodes = NULL;
+    Tensor *inputs[NN_TENSOR_MAX_CHILDREN];
+    int n_inputs = 0;
+    fuse_expr(expr, next_epoch(), &kernel, &cap, inputs, &n_inputs, &nodes);
+    size_t n_nodes = kernel.n_instrs;
+
+    bool fits = true;
+    for (size_t i = 0; i < kernel.n_instrs; i++)
+    {
+        fits &= kernel.instrs[i].op != NN_OP_LEAF || kernel.instrs[i].args[0] < NN_TENSOR_MAX_CHILDREN;
+    }
+    Tensor *out = NULL;
+    if (fits)
+    {
+        out = new_op_tensor(expr->shape_size, expr->shape, inputs, n_inputs, fused_backward);
+        FusedKernel *saved = (FusedKernel *)malloc(sizeof(FusedKernel) + kernel.n_instrs * sizeof(ProgramInstr));
+        saved->n_instrs = kernel.n_instrs;
+        saved->instrs = (ProgramInstr *)(saved + 1);
+        memcpy(saved->instrs, kernel.instrs, kernel.n_instrs * sizeof(ProgramInstr));
+        out->saved = saved;
+
+        size_t nd = out->shape_size;
+        size_t inner = nd == 0 ? 1 : out->shape[nd - 1];
+        size_t rows = inner == 0 ? 0 : out->size / inner;
+        int strides[NN_TENSOR_MAX_CHILDREN][NN_MAX_DIMS];
+        for (int c = 0; c < out->n_children; c++)
+        {
+            broadcast_strides(out->children[c], nd, strides[c]);
+        }
+        nn_real *regs = (nn_real *)malloc(kernel.n_instrs * NN_FUSE_BLOCK * sizeof(nn_real));
+        const nn_real **vals = (const nn_real **)malloc(kernel.n_instrs * sizeof(nn_real *));
+        for (size_t row = 0; row < rows; row++)
+        {
+            for (size_t start = 0; start < inner; start += NN_FUSE_BLOCK)
+            {
+                size_t n = inner - start < NN_FUSE_BLOCK ? inner - start : NN_FUSE_BLOCK;
+                fused_block(saved, out, strides, row, start, n, regs, vals);
+                memcpy(out->data + row * inner + start, vals[kernel.n_instrs - 1], n * sizeof(nn_real));
+            }
+        }
+        free(vals);
+        free(regs);
+    }
+
+    for (size_t i = 0; i < n_nodes; i++)
+    {
+        free(nodes[i]);
+    }
+    free(nodes);
+    free(kernel.instrs);
+    return out;
+}
+
+// dA += dC * B^T and dB += A^T * dC, both through gemm with swapped strides
+void matmul_backward(Tensor *out)
+{
+    Tensor *a = out->children[0];
+    Tensor *b = out->children[1];
+    size_t m = a->shape[0], k = a->shape[1], n = b->shape[1];
+    if (a->requires_grad)
+    {
+        gemm(m, k, n, out->grad, out->strides[0], out->strides[1],
+             b->data, b->strides[1], b->strides[0],
+             tensor_grad(a), a->strides[0], a->strides[1], true);
+    }
+    if (b->requires_grad)
+    {
+        gemm(k, n, m, a->data, a->strides[1], a->strides[0],
+             out->grad, out->strides[0], out->strides[1],
+             tensor_grad(b), b->strides[0], b->strides[1], true);
+    }
+}
+
+// Matrix product of 2-D tensors a (m x k) and b (k x n)
+Tensor *matmul(Tensor *a, Tensor *b)
+{
+    if (a->shape_size != 2 || b->shape_size != 2 || a->shape[1] != b->shape[0])
+    {
+        return NULL;
+    }
+
+    size_t shape[2] = {a->shape[0], b->shape[1]};
+    Tensor *children[2] = {a, b};
+    Tensor *out = new_op_tensor(2, shape, children, 2, matmul_backward);
+    gemm(shape[0], shape[1], a->shape[1], a->data, a->strides[0], a->strides[1],
+         b->data, b->strides[0], b->strides[1], out->data, out->strides[0], out->strides[1], false);
+    return out;
+}
+
+// Output size of a convolution over length input pixels with a kernel of
+// taps taps, 0 if the kernel does not fit
+size_t conv_output_size(size_t length, size_t taps, const Conv2dParams *params)
+{
+    size_t extent = params->dilation * (taps - 1) + 1;
+    if (length + 2 * params->padding < extent)
+    {
+        return 0;
+    }
+    return (length + 2 * params->padding - extent) / params->stride + 1;
+}
+
+// Unfolds image n of input (N, C, H, W) into col, a contiguous
+// (C * KH * KW) x (OH * OW) matrix: row (c, ky, kx) holds the input pixel under
+// that kernel tap for every output position, 0 where it falls in the padding
+void im2col(const Tensor *input, size_t n, size_t kh, size_t kw, size_t oh, size_t ow,
+            const Conv2dParams *params, nn_real *col)
+{
+    size_t channels = input->shape[1], height = input->shape[2], width = input->shape[3];
+    const int *strides = input->strides;
+    for (size_t c = 0; c < channels; c++)
+    {
+        const nn_real *plane = input->data + (ptrdiff_t)n * strides[0] + (ptrdiff_t)c * strides[1];
+        for (size_t ky = 0; ky < kh; ky++)
+        {
+            for (size_t kx = 0; kx < kw; kx++)
+            {
+                for (size_t oy = 0; oy < oh; oy++)
+                {
+                    ptrdiff_t y = (ptrdiff_t)(oy * params->stride + ky * params->dilation) - (ptrdiff_t)params->padding;
+                    for (size_t ox = 0; ox < ow; ox++)
+                    {
+                        ptrdiff_t x = (ptrdiff_t)(ox * params->stride + kx * params->dilation) - (ptrdiff_t)params->padding;
+                        bool inside = y >= 0 && y < (ptrdiff_t)height && x >= 0 && x < (ptrdiff_t)width;
+                        *col++ = inside ? plane[y * strides[2] + x * strides[3]] : 0;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Adjoint of im2col: adds every entry of col to the input pixel it was read
+// from in image n of grad, dropping the padding
+void col2im(const nn_real *col, const Tensor *input, size_t n, size_t kh, size_t kw, size_t oh, size_t ow,
+            const Conv2dParams *params, nn_real *grad)
+{
+    size_t channels = input->shape[1], height = input->shape[2], width = input->shape[3];
+    const int *strides = input->strides;
+    for (size_t c = 0; c < channels; c++)
+    {
+        nn_real *plane = grad + (ptrdiff_t)n * strides[0] + (ptrdiff_t)c * strides[1];
+        for (size_t ky = 0; ky < kh; ky++)
+        {
+            for (size_t kx = 0; kx < kw; kx++)
+            {
+                for (size_t oy = 0; oy < oh; oy++)
+                {
+                    ptrdiff_t y = (ptrdiff_t)(oy * params->stride + ky * params->dilation) - (ptrdiff_t)params->padding;
+                    for (size_t ox = 0; ox < ow; ox++, col++)
+                    {
+                        ptrdiff_t x = (ptrdiff_t)(ox * params->stride + kx * params->dilation) - (ptrdiff_t)params->padding;
+                        if (y >= 0 && y < (ptrdiff_t)height && x >= 0 && x < (ptrdiff_t)width)
+                        {
+                            plane[y * strides[2] + x * strides[3]] += *col;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Per image, with W the weight as an O x (C * KH * KW) matrix and dY the
+// output gradient as O x (OH * OW): dW += dY * col^T, and dcol = W^T * dY
+// folded back onto the input by col2im. col is recomputed, not saved.
+void conv2d_backward(Tensor *out)
+{
+    Tensor *input = out->children[0];
+    Tensor *weight = out->children[1];
+    const Conv2dParams *params = (const Conv2dParams *)out->saved;
+    size_t batch = input->shape[0], filters = weight->shape[0];
+    size_t kh = weight->shape[2], kw = weight->shape[3];
+    size_t oh = out->shape[2], ow = out->shape[3];
+    size_t rows = weight->shape[1] * kh * kw, cols = oh * ow;
+    nn_real *col = (nn_real *)malloc(rows * cols * sizeof(nn_real));
+    for (size_t n = 0; n < batch; n++)
+    {
+        const nn_real *d_out = out->grad + n * filters * cols;
+        if (weight->requires_grad)
+        {
+            im2col(input, n, kh, kw, oh, ow, params, col);
+            gemm(filters, rows, cols, d_out, cols, 1, col, 1, cols,
+                 tensor_grad(weight), weight->strides[0], weight->strides[3], true);
+        }
+        if (input->requires_grad)
+        {
+            gemm(rows, cols, filters, weight->data, weight->strides[3], weight->strides[0],
+                 d_out, cols, 1, col, cols, 1, false);
+            col2im(col, input, n, kh, kw, oh, ow, params, tensor_grad(input));
+        }
+    }
+    free(col);
+}
+
+// 2-D convolution (cross-correlation) of input (N, C, H, W) with weight
+// (O, C, KH, KW), giving (N, O, OH, OW). Each image is unfolded by im2col and
+// multiplied by the weight through gemm. stride and dilation must be at least
+// 1. Returns NULL if the shapes do not match, the kernel does not fit, or the
+// weight's (C, KH, KW) dims are not contiguous.
+Tensor *conv2d(Tensor *input, Tensor *weight, size_t stride, size_t padding, size_t dilation)
+{
+    if (input->shape_size != 4 || weight->shape_size != 4 || input->shape[1] != weight->shape[1] ||
+        weight->shape[2] == 0 || weight->shape[3] == 0 || stride == 0 || dilation == 0)
+    {
+        return NULL;
+    }
+    const int *ws = weight->strides;
+    if ((size_t)ws[2] != weight->shape[3] * ws[3] || (size_t)ws[1] != weight->shape[2] * ws[2])
+    {
+        return NULL;
+    }
+    Conv2dParams params = {stride, padding, dilation};
+    size_t kh = weight->shape[2], kw = weight->shape[3];
+    size_t oh = conv_output_size(input->shape[2], kh, &params);
+    size_t ow = conv_output_size(input->shape[3], kw, &params);
+    if (oh == 0 || ow == 0)
+    {
+        return NULL;
+    }
+
+    size_t shape[4] = {input->shape[0], weight->shape[0], oh, ow};
+    Tensor *children[2] = {input, weight};
+    Tensor *out = new_op_tensor(4, shape, children, 2, conv2d_backward);
+    Conv2dParams *saved = (Conv2dParams *)malloc(sizeof(Conv2dParams));
+    *saved = params;
+    out->saved = saved;
+
+    size_t rows = weight->shape[1] * kh * kw, cols = oh * ow;
+    nn_real *col = (nn_real *)malloc(rows * cols * sizeof(nn_real));
+    for (size_t n = 0; n < shape[0]; n++)
+    {
+        im2col(input, n, kh, kw, oh, ow, &params, col);
+        gemm(shape[1], cols, rows, weight->data, ws[0], ws[3], col, cols, 1,
+             out->data + n * shape[1] * cols, cols, 1, false);
+    }
+    free(col);
+    return out;
+}
+
+// Closed-form backward of the mean cross-entropy: each row of the logits gets
+// (softmax - onehot(target)) / N, with softmax rebuilt from the saved
+// log-sum-exp in the same pass
+void softmax_cross_entropy_backward(Tensor *out)
+{
+    Tensor *logits = out->children[0];
+    const SoftmaxCrossEntropy *saved = (const SoftmaxCrossEntropy *)out->saved;
+    size_t rows = logits->shape[0], classes = logits->shape[1];
+    int rs = logits->strides[0], cs = logits->strides[1];
+    nn_real scale = out->grad[0] / rows;
+    nn_real *buf = (nn_real *)malloc(classes * sizeof(nn_real));
+    nn_real *grad = tensor_grad(logits);
+    for (size_t i = 0; i < rows; i++)
+    {
+        const nn_real *x = gather_row(logits->data + (ptrdiff_t)i * rs, cs, classes, buf);
+        nn_real *dx = grad + (ptrdiff_t)i * rs;
+        nn_real lse = saved->lse[i];
+        for (size_t j = 0; j < classes; j++)
+        {
+            dx[j * cs] += scale * exp(x[j] - lse);
+        }
+        dx[saved->targets[i] * cs] -= scale;
+    }
+    free(buf);
+}
+
+// Mean cross-entropy of softmax(logits) against targets, as one op: logits is
+// (N, C) and targets holds the class index of each row, as tensor_argmax
+// returns them. Each row costs a max and a sum of exps (log-sum-exp, so large
+// logits cannot overflow). Returns NULL if the shapes do not match or a
+// target is not a class index.
+Tensor *softmax_cross_entropy(Tensor *logits, const Tensor *targets)
+{
+    if (logits->shape_size != 2 || targets->shape_size != 1 || targets->shape[0] != logits->shape[0])
+    {
+        return NULL;
+    }
+    size_t rows = logits->shape[0], classes = logits->shape[1];
+    SoftmaxCrossEntropy *saved =
+        (SoftmaxCrossEntropy *)malloc(sizeof(SoftmaxCrossEntropy) + rows * (sizeof(size_t) + sizeof(nn_real)));
+    saved->targets = (size_t *)(saved + 1);
+    saved->lse = (nn_real *)(saved->targets + rows);
+    for (size_t i = 0; i < rows; i++)
+    {
+        nn_real target = targets->data[(ptrdiff_t)i * targets->strides[0]];
+        if (!(target >= 0 && target < classes) || target != (size_t)target)
+        {
+            free(saved);
+            return NULL;
+        }
+        saved->targets[i] = (size_t)target;
+    }
+
+    int rs = logits->strides[0], cs = logits->strides[1];
+    nn_real *buf = (nn_real *)malloc(classes * sizeof(nn_real));
+    nn_real *losses = (nn_real *)malloc(rows * sizeof(nn_real));
+    for (size_t i = 0; i < rows; i++)
+    {
+        const nn_real *x = gather_row(logits->data + (ptrdiff_t)i * rs, cs, classes, buf);
+        nn_real max = -INFINITY;
+        for (size_t j = 0; j < classes; j++)
+        {
+            max = x[j] > max ? x[j] : max;
+        }
+        nn_real sum = 0;
+        for (size_t j = 0; j < classes; j++)
+        {
+            sum += exp(x[j] - max);
+        }
+        saved->lse[i] = max + log(sum);
+        losses[i] = saved->lse[i] - x[saved->targets[i]];
+    }
+
+    Tensor *out = new_op_tensor(0, NULL, &logits, 1, softmax_cross_entropy_backward);
+    out->saved = saved;
+    out->data[0] = rows == 0 ? 0 : pairwise_sum(losses, rows) / rows;
+    free(losses);
+    free(buf);
+    return out;
+}
 
 #endif // NN
\ No newline at end of file
@@ -75,23 +75,12 @@ int main()
     get_gradients(grad_alloc, independent_vars, 2);
 
     printf("### grad_alloc: ###\n");
-    for (int idx = 0; idx < grad_alloc->n_indep_vars; idx++)
+    for (size_t idx = 0; idx < grad_alloc->n_dep_vars; idx++)
     {
-        printf("hashmap size: %zu\n", hashmap_count(grad_alloc->dep_grad_map));
-
-        Variable *indep_var = grad_alloc->independent_vars[idx];
-
-        size_t iter = 0;
-        Variable *item;
-        int idx = 0;
-
-        while (hashmap_iter(grad_alloc->dep_grad_map, &iter, &item))
-        {
-            printf("%i, %f, %p, %f, %f\n", idx, indep_var->val, grad_alloc->dependent_vars[idx], grad_alloc->dependent_vars[idx]->val, item->val);
-            idx++;
-        }
-        printf("-----------------\n");
+        Variable *dep_var = grad_alloc->dependent_vars[idx];
+        printf("%zu, %p, %f, %f\n", idx, (void *)dep_var, dep_var->val, grad_alloc->grads[idx]);
     }
+    printf("-----------------\n");
 
     free_from_variable(final_res);
     return 0;
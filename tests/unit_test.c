@@ -1,5 +1,9 @@
 #include "NN.h"
 #include "unity/unity.h"
+#include <pthread.h>
+
+// relative tolerance for results that only differ in summation order
+#define SUM_ORDER_TOLERANCE (sizeof(nn_real) < sizeof(double) ? 1e-4 : 1e-9)
 
 void setUp(void)
 {
@@ -48,6 +52,8 @@ void test_Subtraction(void)
     TEST_ASSERT_EQUAL_DOUBLE(1.0, sub_res->val);
     TEST_ASSERT_EQUAL_MEMORY(&x, sub_res->children[0], sizeof(Variable));
     TEST_ASSERT_EQUAL_MEMORY(&y, sub_res->children[1], sizeof(Variable));
+    TEST_ASSERT_EQUAL_DOUBLE(1.0, sub_res->local_grads[0]);
+    TEST_ASSERT_EQUAL_DOUBLE(-1.0, sub_res->local_grads[1]);
 
     free_from_variable(sub_res);
 }
@@ -151,24 +157,1487 @@ void test_get_gradients(void)
     TEST_ASSERT_EQUAL_size_t(n_vars, grad_alloc.n_indep_vars); // 2
     TEST_ASSERT_EQUAL_size_t(3, grad_alloc.n_dep_vars); // 3
 
-    for (int idx = 0; idx < grad_alloc.n_indep_vars; idx++)
+    for (size_t idx = 0; idx < grad_alloc.n_dep_vars; idx++)
+    {
+        Variable *dep_var = grad_alloc.dependent_vars[idx];
+        printf("%zu, %p, %f, %f\n", idx, (void *)dep_var, dep_var->val, grad_alloc.grads[idx]);
+    }
+    printf("-----------------\n");
+
+    // d(sigmoid(m) + relu(m))/dm, with m = (x0 + x1) * (x1 + x2)
+    double sig = final_res->val;
+    double d_mul = sig * (1 - sig) + 1;
+    TEST_ASSERT_EQUAL_DOUBLE(d_mul, get_gradient(&grad_alloc, mul_res));
+    TEST_ASSERT_EQUAL_DOUBLE(d_mul * add_res_1->val, get_gradient(&grad_alloc, add_res));
+    TEST_ASSERT_EQUAL_DOUBLE(d_mul * add_res->val, get_gradient(&grad_alloc, add_res_1));
+    TEST_ASSERT_EQUAL_DOUBLE(0.0, get_gradient(&grad_alloc, &x1));
+    // gradients are stored densely in the allocator, in dependent_vars order
+    for (size_t idx = 0; idx < grad_alloc.n_dep_vars; idx++)
     {
-        printf("hashmap size: %zu\n", hashmap_count(grad_alloc.dep_grad_map));
+        TEST_ASSERT_EQUAL_DOUBLE(get_gradient(&grad_alloc, grad_alloc.dependent_vars[idx]), grad_alloc.grads[idx]);
+    }
+
+    // a new allocator starts again from zero
+    VariablesGradAllocator grad_alloc_1;
+    init_grad_alloc(&grad_alloc_1);
+    get_gradients(&grad_alloc_1, independent_vars, 1);
+    TEST_ASSERT_EQUAL_DOUBLE(sig * (1 - sig), get_gradient(&grad_alloc_1, mul_res));
+    // each allocator keeps its own gradients
+    TEST_ASSERT_EQUAL_DOUBLE(d_mul, get_gradient(&grad_alloc, mul_res));
+
+    // a second pass adds to the gradients of the first
+    get_gradients(&grad_alloc_1, &final_res_1, 1);
+    TEST_ASSERT_EQUAL_size_t(3, grad_alloc_1.n_dep_vars);
+    TEST_ASSERT_EQUAL_DOUBLE(d_mul, get_gradient(&grad_alloc_1, mul_res));
+    TEST_ASSERT_EQUAL_DOUBLE(d_mul * add_res->val, get_gradient(&grad_alloc_1, add_res_1));
+
+    // mul_res is shared by both outputs, but must only be freed once
+    free_graph(independent_vars, n_vars);
+    free(independent_vars);
+    free_grad_buffers(&grad_alloc);
+    free_grad_buffers(&grad_alloc_1);
+}
+
+// every layer doubles the number of paths from the root to x, so this only
+// finishes if each edge is swept once
+void test_get_gradients_shared_subexpressions(void)
+{
+    VariablesGradAllocator grad_alloc;
+    init_grad_alloc(&grad_alloc);
+
+    Variable x;
+    init_var(&x, 1.0, true);
+
+    Variable *out = &x;
+    for (int layer = 0; layer < 100; layer++)
+    {
+        out = add(out, out);
+    }
+
+    get_gradients(&grad_alloc, &out, 1);
+
+    TEST_ASSERT_EQUAL_size_t(1, grad_alloc.n_dep_vars);
+    TEST_ASSERT_EQUAL_DOUBLE(pow(2, 100), get_gradient(&grad_alloc, &x));
+
+    free_from_variable(out);
+    free_grad_buffers(&grad_alloc);
+}
+
+void test_get_gradients_deep_graph(void)
+{
+    VariablesGradAllocator grad_alloc;
+    init_grad_alloc(&grad_alloc);
+
+    Variable x;
+    init_var(&x, 1.0, true);
+
+    // 200k chained adds, far deeper than the C stack could recurse
+    Variable *out = &x;
+    for (int idx = 0; idx < 200000; idx++)
+    {
+        out = add(out, &x);
+    }
+    TEST_ASSERT_EQUAL_DOUBLE(200001.0, out->val);
+
+    get_gradients(&grad_alloc, &out, 1);
+    TEST_ASSERT_EQUAL_DOUBLE(200001.0, get_gradient(&grad_alloc, &x));
+
+    free_from_variable(out);
+    free_grad_buffers(&grad_alloc);
+}
+
+void test_get_gradients_pruned(void)
+{
+    VariablesGradAllocator grad_alloc;
+    init_grad_alloc(&grad_alloc);
+
+    Variable c, w;
+    init_var(&c, 0.5, false);
+    init_var(&w, 2.0, true);
+
+    // a constant preprocessing chain, then the only trainable input
+    Variable *pre = &c;
+    for (int idx = 0; idx < 1000; idx++)
+    {
+        pre = sigmoid(add(pre, &c));
+    }
+    TEST_ASSERT_FALSE(pre->requires_grad);
+
+    // the constant is the first operand, w must still be reached after it
+    Variable *out = mul(pre, &w);
+    TEST_ASSERT_TRUE(out->requires_grad);
+
+    get_gradients(&grad_alloc, &out, 1);
+    TEST_ASSERT_EQUAL_DOUBLE(pre->val, get_gradient(&grad_alloc, &w));
+    size_t slot;
+    TEST_ASSERT_FALSE(sorted_slot(&grad_alloc, pre, &slot));
+    TEST_ASSERT_FALSE(sorted_slot(&grad_alloc, &c, &slot));
+
+    free_from_variable(out);
+    free_grad_buffers(&grad_alloc);
+}
+
+void test_get_gradients_seeded(void)
+{
+    VariablesGradAllocator grad_alloc;
+    init_grad_alloc(&grad_alloc);
+
+    Variable x, w;
+    init_var(&x, 3.0, true);
+    init_var(&w, 5.0, true);
+
+    Variable *h = mul(&x, &w);
+    Variable *outs[3] = {sigmoid(h), add(&x, &w), h};
+    nn_real seeds[3] = {2.0, 3.0, -1.0};
+
+    get_gradients_seeded(&grad_alloc, outs, seeds, 3);
+
+    double sig = outs[0]->val;
+    double d_h = 2.0 * sig * (1 - sig) - 1.0;
+    TEST_ASSERT_EQUAL_size_t(3, grad_alloc.n_indep_vars);
+    TEST_ASSERT_EQUAL_DOUBLE(d_h * 5.0 + 3.0, get_gradient(&grad_alloc, &x));
+    TEST_ASSERT_EQUAL_DOUBLE(d_h * 3.0 + 3.0, get_gradient(&grad_alloc, &w));
+
+    free_graph(outs, 3);
+    free_grad_buffers(&grad_alloc);
+}
 
-        Variable *indep_var = grad_alloc.independent_vars[idx];
+void test_get_gradients_lanes(void)
+{
+    Variable x, y;
+    init_var(&x, 0.4, true);
+    init_var(&y, 1.7, true);
 
-        size_t iter = 0;
-        Variable *item;
-        int idx = 0;
+    // three rows of a Jacobian, sharing the subexpression h
+    Variable *h = sigmoid(mul(&x, &y));
+    Variable *outs[3] = {add(h, &x), mul(h, &y), power(h, 3)};
+
+    // reference rows, one sweep each
+    Variable *wrt[2] = {&x, &y};
+    double expected[3][2];
+    for (int row = 0; row < 3; row++)
+    {
+        VariablesGradAllocator grad_alloc;
+        init_grad_alloc(&grad_alloc);
+        get_gradients(&grad_alloc, &outs[row], 1);
+        for (int col = 0; col < 2; col++)
+        {
+            expected[row][col] = get_gradient(&grad_alloc, wrt[col]);
+        }
+        free_grad_buffers(&grad_alloc);
+    }
 
-        while (hashmap_iter(grad_alloc.dep_grad_map, &iter, &item))
+    VariablesGradAllocator lanes;
+    init_grad_alloc(&lanes);
+    get_gradients_lanes(&lanes, outs, 3);
+    for (int row = 0; row < 3; row++)
+    {
+        for (int col = 0; col < 2; col++)
         {
-            printf("%i, %f, %p, %f, %f\n", idx, indep_var->val, grad_alloc.dependent_vars[idx], grad_alloc.dependent_vars[idx]->val, item->val);
-            idx++;
+            TEST_ASSERT_EQUAL_DOUBLE(expected[row][col], get_gradient_lane(&lanes, wrt[col], row));
         }
-        printf("-----------------\n");
     }
+    TEST_ASSERT_EQUAL_DOUBLE(0.0, get_gradient_lane(&lanes, &x, 3));
+
+    // another allocator sorting a wider graph over h puts h in another slot;
+    // the lanes must not change, and neither must its gradients after the
+    // lanes are swept again
+    Variable z;
+    init_var(&z, -0.8, true);
+    Variable *wider = add(mul(&z, &z), power(h, 2));
+    h->can_grad = true;
+    VariablesGradAllocator other;
+    init_grad_alloc(&other);
+    get_gradients(&other, &wider, 1);
+    TEST_ASSERT_EQUAL_DOUBLE(3 * h->val * h->val, get_gradient_lane(&lanes, h, 2));
+    for (int row = 0; row < 3; row++)
+    {
+        for (int col = 0; col < 2; col++)
+        {
+            TEST_ASSERT_EQUAL_DOUBLE(expected[row][col], get_gradient_lane(&lanes, wrt[col], row));
+        }
+    }
+    get_gradients_lanes(&lanes, outs, 3);
+    TEST_ASSERT_EQUAL_DOUBLE(2 * h->val, get_gradient(&other, h));
+    TEST_ASSERT_EQUAL_DOUBLE(2 * z.val, get_gradient(&other, &z));
+
+    free_from_variable(wider);
+    free_grad_buffers(&other);
+    free_grad_buffers(&lanes);
+    free_graph(outs, 3);
+}
+
+void test_refcount(void)
+{
+    Variable x, y;
+    init_var(&x, 2.0, true);
+    init_var(&y, 3.0, true);
+
+    // h is shared by both parents, a by out and by the caller
+    Variable *h = mul(&x, &y);
+    Variable *a = sigmoid(h);
+    Variable *out = add(mul(a, h), h);
+    TEST_ASSERT_EQUAL_size_t(3, h->refcount);
+    TEST_ASSERT_EQUAL_size_t(1, a->refcount);
+    TEST_ASSERT_EQUAL_size_t(1, x.refcount);
+
+    // keep the activation around past the graph that consumed it
+    retain_variable(a);
+    free_from_variable(out);
+    TEST_ASSERT_EQUAL_size_t(1, a->refcount);
+    TEST_ASSERT_EQUAL_size_t(1, h->refcount);
+    TEST_ASSERT_EQUAL_DOUBLE(6.0, h->val);
+
+    release_variable(a);
+    TEST_ASSERT_EQUAL_size_t(0, x.refcount);
+    TEST_ASSERT_EQUAL_size_t(0, y.refcount);
+
+    // outputs that sit below each other are freed once
+    h = mul(&x, &y);
+    Variable *outs[3] = {h, sigmoid(h), add(h, &x)};
+    free_graph(outs, 3);
+    TEST_ASSERT_EQUAL_size_t(0, x.refcount);
+}
+
+// one checkpoint region: 10 layers of h = sigmoid(h * w + b). Counts its
+// runs in *arg, if given.
+Variable *checkpoint_test_region(Variable **inputs, size_t n_inputs, void *arg)
+{
+    if (arg != NULL)
+    {
+        (*(int *)arg)++;
+    }
+    Variable *h = inputs[0];
+    for (int idx = 0; idx < 10; idx++)
+    {
+        h = sigmoid(add(mul(h, inputs[1]), inputs[2]));
+    }
+    return h;
+}
+
+void test_checkpoint(void)
+{
+    Variable x, w, b;
+    init_var(&x, 0.3, true);
+    init_var(&w, 1.5, true);
+    init_var(&b, -0.2, true);
+
+    // the same 100 layers, plain and as 10 checkpoint regions
+    Variable *inputs[3] = {&x, &w, &b};
+    Variable *plain = &x;
+    for (int idx = 0; idx < 10; idx++)
+    {
+        inputs[0] = plain;
+        plain = checkpoint_test_region(inputs, 3, NULL);
+    }
+    Variable *ckpt = &x;
+    for (int idx = 0; idx < 10; idx++)
+    {
+        inputs[0] = ckpt;
+        ckpt = checkpoint(checkpoint_test_region, inputs, 3, NULL);
+    }
+    TEST_ASSERT_EQUAL_DOUBLE(plain->val, ckpt->val);
+    TEST_ASSERT_EQUAL_INT(NN_OP_CHECKPOINT, ckpt->op);
+    TEST_ASSERT_EQUAL_INT(3, ckpt->n_children);
+
+    VariablesGradAllocator plain_grads, ckpt_grads;
+    init_grad_alloc(&plain_grads);
+    get_gradients(&plain_grads, &plain, 1);
+    double d_x = get_gradient(&plain_grads, &x);
+    double d_w = get_gradient(&plain_grads, &w);
+    double d_b = get_gradient(&plain_grads, &b);
+
+    init_grad_alloc(&ckpt_grads);
+    get_gradients(&ckpt_grads, &ckpt, 1);
+    TEST_ASSERT_TRUE(ckpt->region->ready);
+    TEST_ASSERT_EQUAL_DOUBLE(d_x, get_gradient(&ckpt_grads, &x));
+    TEST_ASSERT_EQUAL_DOUBLE(d_w, get_gradient(&ckpt_grads, &w));
+    TEST_ASSERT_EQUAL_DOUBLE(d_b, get_gradient(&ckpt_grads, &b));
+
+    // a program cannot replay a region, so capturing one is refused
+    Program prog;
+    Variable *captured = sigmoid(ckpt);
+    inputs[0] = &x;
+    TEST_ASSERT_FALSE(program_capture(&prog, inputs, 3, &captured, 1));
+    TEST_ASSERT_EQUAL_size_t(0, prog.n_instrs);
+    program_free(&prog);
+
+    free_grad_buffers(&plain_grads);
+    free_grad_buffers(&ckpt_grads);
+    Variable *outs[2] = {plain, captured};
+    free_graph(outs, 2);
+    TEST_ASSERT_EQUAL_size_t(0, w.refcount);
+}
+
+void test_higher_order(void)
+{
+    Variable x, y;
+    init_var(&x, 0.7, true);
+    init_var(&y, -1.3, true);
+
+    // f = x^3 y + sigmoid(x y) - x
+    Variable *xy = mul(&x, &y);
+    Variable *f = sub(add(mul(power(&x, 3), &y), sigmoid(xy)), &x);
+
+    Variable *wrt[2] = {&x, &y};
+    Variable *grads[2];
+    get_gradients_graph(&f, NULL, 1, wrt, grads, 2);
+
+    double s = 1 / (1 + exp(-x.val * y.val));
+    double ds = s * (1 - s);
+    double dds = ds * (1 - 2 * s);
+    TEST_ASSERT_EQUAL_DOUBLE(3 * x.val * x.val * y.val + ds * y.val - 1, grads[0]->val);
+    TEST_ASSERT_EQUAL_DOUBLE(pow(x.val, 3) + ds * x.val, grads[1]->val);
+
+    // the gradient is a graph again: second derivatives of f
+    VariablesGradAllocator grad_alloc;
+    init_grad_alloc(&grad_alloc);
+    get_gradients(&grad_alloc, &grads[0], 1);
+    TEST_ASSERT_EQUAL_DOUBLE(6 * x.val * y.val + dds * y.val * y.val, get_gradient(&grad_alloc, &x));
+    TEST_ASSERT_EQUAL_DOUBLE(3 * x.val * x.val + ds + dds * x.val * y.val, get_gradient(&grad_alloc, &y));
+    free_grad_buffers(&grad_alloc);
+
+    // wrt nodes not below the root get a constant 0
+    Variable z;
+    init_var(&z, 1.0, true);
+    Variable *grad_z;
+    get_gradients_graph(&f, NULL, 1, (Variable *[]){&z}, &grad_z, 1);
+    TEST_ASSERT_EQUAL_DOUBLE(0.0, grad_z->val);
+
+    // the gradient graphs keep the shared forward nodes alive
+    Variable *outs[4] = {grads[0], grads[1], grad_z, f};
+    free_graph(outs, 4);
+    TEST_ASSERT_EQUAL_size_t(0, x.refcount);
+    TEST_ASSERT_EQUAL_size_t(0, y.refcount);
+
+    // checkpoint regions are rebuilt as graphs, second derivatives match
+    Variable *inputs[3] = {&x, &y, &z};
+    Variable *plain = checkpoint_test_region(inputs, 3, NULL);
+    int region_runs = 0;
+    Variable *ckpt = checkpoint(checkpoint_test_region, inputs, 3, &region_runs);
+    Variable *d_plain, *d_ckpt;
+    get_gradients_graph(&plain, NULL, 1, &inputs[1], &d_plain, 1);
+    get_gradients_graph(&ckpt, NULL, 1, &inputs[1], &d_ckpt, 1);
+    TEST_ASSERT_EQUAL_DOUBLE(d_plain->val, d_ckpt->val);
+    // once forward, once rebuilt as a graph: no scalar recompute on the way
+    TEST_ASSERT_EQUAL_INT(2, region_runs);
+
+    init_grad_alloc(&grad_alloc);
+    get_gradients(&grad_alloc, &d_plain, 1);
+    double dd_plain = get_gradient(&grad_alloc, &x);
+    free_grad_buffers(&grad_alloc);
+    init_grad_alloc(&grad_alloc);
+    get_gradients(&grad_alloc, &d_ckpt, 1);
+    TEST_ASSERT_EQUAL_DOUBLE(dd_plain, get_gradient(&grad_alloc, &x));
+    free_grad_buffers(&grad_alloc);
+
+    Variable *ckpt_outs[4] = {d_plain, d_ckpt, plain, ckpt};
+    free_graph(ckpt_outs, 4);
+    TEST_ASSERT_EQUAL_size_t(0, x.refcount);
+}
+
+void test_arena(void)
+{
+    Arena arena;
+    arena_init(&arena, 1024); // small chunks, so the graph spans several
+    Arena *prev_arena = bind_arena(&arena);
+
+    Variable x, y;
+    init_var(&x, 2.0, true);
+    init_var(&y, 3.0, true);
+
+    Variable *first_node = NULL;
+    for (int step = 0; step < 2; step++)
+    {
+        VariablesGradAllocator grad_alloc;
+        init_grad_alloc(&grad_alloc);
+
+        Variable *node = mul(&x, &y);
+        Variable *out = node;
+        for (int idx = 0; idx < 1000; idx++)
+        {
+            out = add(out, &x);
+        }
+
+        TEST_ASSERT_EQUAL_INT(NN_STORAGE_ARENA, out->storage);
+        TEST_ASSERT_EQUAL_DOUBLE(2006.0, out->val);
+
+        get_gradients(&grad_alloc, &out, 1);
+        TEST_ASSERT_EQUAL_DOUBLE(1003.0, get_gradient(&grad_alloc, &x));
+        TEST_ASSERT_EQUAL_DOUBLE(2.0, get_gradient(&grad_alloc, &y));
+
+        // after a reset the next step reuses the same memory
+        if (step == 0)
+        {
+            first_node = node;
+        }
+        else
+        {
+            TEST_ASSERT_EQUAL_PTR(first_node, node);
+        }
+        free_grad_buffers(&grad_alloc);
+        arena_reset(&arena);
+    }
+    // the resets dropped the references the arena nodes took on the leaves
+    TEST_ASSERT_EQUAL_size_t(0, x.refcount);
+    TEST_ASSERT_EQUAL_size_t(0, y.refcount);
+
+    // a heap node consumed by an arena graph lives until the next reset
+    bind_arena(NULL);
+    Variable *heap_node = mul(&x, &x);
+    retain_variable(heap_node);
+    bind_arena(&arena);
+    Variable *arena_out = add(heap_node, &y);
+    release_variable(heap_node);
+    TEST_ASSERT_EQUAL_DOUBLE(4.0, heap_node->val);
+    TEST_ASSERT_EQUAL_DOUBLE(7.0, arena_out->val);
+    arena_reset(&arena);
+    TEST_ASSERT_EQUAL_size_t(0, x.refcount);
+
+    bind_arena(prev_arena);
+    arena_free(&arena);
+}
+
+void test_tape(void)
+{
+    Tape tape;
+    tape_init(&tape);
+
+    Variable x0, x1, x2;
+    init_var(&x0, 0.5, true);
+    init_var(&x1, 0.3, true);
+    init_var(&x2, 0.1, true);
+
+    Tape *prev_tape = bind_tape(&tape);
+    Variable *add_res = add(&x0, &x1);
+    Variable *add_res_1 = add(&x1, &x2);
+    Variable *mul_res = mul(add_res, add_res_1);
+    Variable *out = add(sigmoid(mul_res), relu(mul_res));
+    bind_tape(prev_tape);
+
+    // values are computed eagerly, but nothing is linked by pointer
+    TEST_ASSERT_EQUAL_DOUBLE(0.32, mul_res->val);
+    TEST_ASSERT_NULL(out->children);
+    // and the tape owns the values it hands back
+    TEST_ASSERT_EQUAL_INT(NN_STORAGE_ARENA, out->storage);
+    // 3 leaves (x1 is only recorded once) + 6 ops
+    TEST_ASSERT_EQUAL_size_t(9, tape.n_entries);
+
+    tape_backward(&tape, &out, NULL, 1);
+
+    double sig = 1 / (1 + exp(-0.32));
+    double d_mul = sig * (1 - sig) + 1;
+    TEST_ASSERT_EQUAL_DOUBLE(d_mul, tape_gradient(&tape, mul_res));
+    TEST_ASSERT_EQUAL_DOUBLE(d_mul * 0.4, tape_gradient(&tape, &x0));
+    TEST_ASSERT_EQUAL_DOUBLE(d_mul * (0.4 + 0.8), tape_gradient(&tape, &x1));
+    TEST_ASSERT_EQUAL_DOUBLE(d_mul * 0.8, tape_gradient(&tape, &x2));
+
+    // seeded sweep from two roots at once
+    Variable *roots[2] = {add_res, add_res_1};
+    nn_real seeds[2] = {2.0, 3.0};
+    tape_backward(&tape, roots, seeds, 2);
+    TEST_ASSERT_EQUAL_DOUBLE(2.0, tape_gradient(&tape, &x0));
+    TEST_ASSERT_EQUAL_DOUBLE(5.0, tape_gradient(&tape, &x1));
+    TEST_ASSERT_EQUAL_DOUBLE(3.0, tape_gradient(&tape, &x2));
+
+    // after a reset, old values are no longer on the tape
+    tape_reset(&tape);
+    TEST_ASSERT_EQUAL_DOUBLE(0.0, tape_gradient(&tape, &x0));
+
+    tape_free(&tape);
+}
+
+// builds sigmoid(w * x + b)^2 - x
+Variable *program_test_graph(Variable *x, Variable *w, Variable *b)
+{
+    return sub(power(sigmoid(add(mul(w, x), b)), 2), x);
+}
+
+void test_program(void)
+{
+    Variable x, w, b;
+    init_var(&x, 0.5, true);
+    init_var(&w, -1.5, true);
+    init_var(&b, 0.25, true);
+
+    Variable *out = program_test_graph(&x, &w, &b);
+    Variable *inputs[3] = {&x, &w, &b};
+
+    Program prog;
+    TEST_ASSERT_TRUE(program_capture(&prog, inputs, 3, &out, 1));
+    free_from_variable(out);
+
+    // 3 inputs + 5 ops
+    TEST_ASSERT_EQUAL_size_t(8, prog.n_instrs);
+
+    double values[2][3] = {{0.5, -1.5, 0.25}, {-2.0, 0.75, 1.0}};
+    for (int step = 0; step < 2; step++)
+    {
+        for (size_t idx = 0; idx < 3; idx++)
+        {
+            program_set_input(&prog, idx, values[step][idx]);
+        }
+        program_forward(&prog);
+        program_backward(&prog, NULL);
+
+        // replay must match a freshly built graph
+        Variable x_1, w_1, b_1;
+        init_var(&x_1, values[step][0], true);
+        init_var(&w_1, values[step][1], true);
+        init_var(&b_1, values[step][2], true);
+        Variable *out_1 = program_test_graph(&x_1, &w_1, &b_1);
+
+        VariablesGradAllocator grad_alloc;
+        init_grad_alloc(&grad_alloc);
+        get_gradients(&grad_alloc, &out_1, 1);
+
+        TEST_ASSERT_EQUAL_DOUBLE(out_1->val, program_output(&prog, 0));
+        TEST_ASSERT_EQUAL_DOUBLE(get_gradient(&grad_alloc, &x_1), program_gradient(&prog, 0));
+        TEST_ASSERT_EQUAL_DOUBLE(get_gradient(&grad_alloc, &w_1), program_gradient(&prog, 1));
+        TEST_ASSERT_EQUAL_DOUBLE(get_gradient(&grad_alloc, &b_1), program_gradient(&prog, 2));
+
+        free_from_variable(out_1);
+        free_grad_buffers(&grad_alloc);
+    }
+
+    program_free(&prog);
+}
+
+void test_forward_mode(void)
+{
+    // lane 0: d/dx, lane 1: d/dw, lane 2: along (1, 1)
+    nn_real x_tangent[NN_DUAL_LANES] = {1, 0, 1};
+    nn_real w_tangent[NN_DUAL_LANES] = {0, 1, 1};
+    Dual x = dual_var(0.5, x_tangent);
+    Dual w = dual_var(-1.5, w_tangent);
+    Dual out = dual_sub(dual_power(dual_sigmoid(dual_mul(w, x)), 2), dual_relu(x));
+
+    // same function in reverse mode
+    Variable x_1, w_1;
+    init_var(&x_1, 0.5, true);
+    init_var(&w_1, -1.5, true);
+    Variable *out_1 = sub(power(sigmoid(mul(&w_1, &x_1)), 2), relu(&x_1));
+    VariablesGradAllocator grad_alloc;
+    init_grad_alloc(&grad_alloc);
+    get_gradients(&grad_alloc, &out_1, 1);
+
+    double d_x = get_gradient(&grad_alloc, &x_1);
+    double d_w = get_gradient(&grad_alloc, &w_1);
+    TEST_ASSERT_EQUAL_DOUBLE(out_1->val, out.val);
+    TEST_ASSERT_EQUAL_DOUBLE(d_x, out.tan[0]);
+    TEST_ASSERT_EQUAL_DOUBLE(d_w, out.tan[1]);
+    TEST_ASSERT_EQUAL_DOUBLE(d_x + d_w, out.tan[2]);
+    TEST_ASSERT_EQUAL_DOUBLE(0.0, out.tan[3]);
+
+    free_from_variable(out_1);
+    free_grad_buffers(&grad_alloc);
+}
+
+// builds and differentiates a long chain in its own context, returns the
+// gradient w.r.t. the leaf (or -1 if ids were not handed out in sequence)
+void *graph_context_worker(void *arg)
+{
+    double *result = (double *)arg;
+    GraphContext ctx;
+    graph_context_init(&ctx);
+    bind_graph_context(&ctx);
+
+    for (int step = 0; step < 3; step++)
+    {
+        Variable x;
+        init_var(&x, 1.0, true);
+        uint64_t first_id = x.id;
+
+        Variable *out = &x;
+        for (int idx = 0; idx < 5000; idx++)
+        {
+            out = add(mul(out, &x), &x);
+        }
+
+        get_gradients(&ctx.grad_alloc, &out, 1);
+        *result = out->id - first_id == 10000 ? get_gradient(&ctx.grad_alloc, &x) : -1;
+        graph_context_reset(&ctx);
+    }
+
+    bind_graph_context(NULL);
+    graph_context_free(&ctx);
+    return NULL;
+}
+
+void test_graph_context_threads(void)
+{
+    pthread_t threads[4];
+    double results[4];
+    for (int idx = 0; idx < 4; idx++)
+    {
+        pthread_create(&threads[idx], NULL, graph_context_worker, &results[idx]);
+    }
+    for (int idx = 0; idx < 4; idx++)
+    {
+        pthread_join(threads[idx], NULL);
+    }
+
+    // out_n = n + 1 at x = 1, and d out_n/dx = d out_{n-1}/dx + out_{n-1} + 1
+    double expected = 1.0;
+    for (int idx = 1; idx <= 5000; idx++)
+    {
+        expected += idx + 1;
+    }
+    for (int idx = 0; idx < 4; idx++)
+    {
+        TEST_ASSERT_EQUAL_DOUBLE(expected, results[idx]);
+    }
+
+    // the calling thread still has its own default context
+    TEST_ASSERT_NULL(graph_context()->arena);
+}
+
+#define N_SHARED 256
+Variable shared_weights[N_SHARED];
+
+// differentiates sum_i w_i * (i + seed) over the shared weights, in an arena
+// context and on the heap. arg holds the seed, and gets the number of wrong
+// gradients.
+void *shared_leaves_worker(void *arg)
+{
+    int seed = *(int *)arg;
+    int errors = 0;
+    GraphContext ctx;
+    graph_context_init(&ctx);
+
+    for (int step = 0; step < 50; step++)
+    {
+        // heap nodes on odd steps, so the weights' refcounts go up and down
+        bind_graph_context(step % 2 == 0 ? &ctx : NULL);
+        Variable *out = constant(0);
+        for (int idx = 0; idx < N_SHARED; idx++)
+        {
+            out = add(out, mul(&shared_weights[idx], constant(idx + seed)));
+        }
+
+        VariablesGradAllocator grad_alloc;
+        init_grad_alloc(&grad_alloc);
+        get_gradients(&grad_alloc, &out, 1);
+        for (int idx = 0; idx < N_SHARED; idx++)
+        {
+            errors += get_gradient(&grad_alloc, &shared_weights[idx]) != idx + seed;
+        }
+        free_grad_buffers(&grad_alloc);
+        if (step % 2 == 0)
+        {
+            graph_context_reset(&ctx);
+        }
+        else
+        {
+            free_from_variable(out);
+        }
+    }
+
+    bind_graph_context(NULL);
+    graph_context_free(&ctx);
+    *(int *)arg = errors;
+    return NULL;
+}
+
+void test_graph_context_shared_leaves(void)
+{
+    for (int idx = 0; idx < N_SHARED; idx++)
+    {
+        init_var(&shared_weights[idx], idx * 0.5, true);
+        retain_variable(&shared_weights[idx]);
+    }
+
+    pthread_t threads[8];
+    int results[8];
+    for (int idx = 0; idx < 8; idx++)
+    {
+        results[idx] = idx + 1;
+        pthread_create(&threads[idx], NULL, shared_leaves_worker, &results[idx]);
+    }
+    for (int idx = 0; idx < 8; idx++)
+    {
+        pthread_join(threads[idx], NULL);
+    }
+    for (int idx = 0; idx < 8; idx++)
+    {
+        TEST_ASSERT_EQUAL_INT(0, results[idx]);
+    }
+
+    // every reference the threads' graphs took was dropped again, by freeing
+    // the heap graphs and resetting the arenas
+    for (int idx = 0; idx < N_SHARED; idx++)
+    {
+        TEST_ASSERT_EQUAL_size_t(1, atomic_load(&shared_weights[idx].refcount));
+        release_variable(&shared_weights[idx]);
+    }
+}
+
+void test_get_gradients_parallel(void)
+{
+    GraphContext ctx;
+    graph_context_init(&ctx);
+    bind_graph_context(&ctx);
+
+    // 64 independent chains sharing x, summed into one output
+    Variable x, w[64];
+    init_var(&x, 0.5, true);
+    Variable *out = NULL;
+    for (int chain = 0; chain < 64; chain++)
+    {
+        init_var(&w[chain], 0.01 * (chain + 1), true);
+        Variable *h = &x;
+        for (int idx = 0; idx < 200; idx++)
+        {
+            h = sigmoid(add(mul(h, &w[chain]), &x));
+        }
+        out = out == NULL ? h : add(out, h);
+    }
+
+    double expected[65];
+    get_gradients(&ctx.grad_alloc, &out, 1);
+    expected[64] = get_gradient(&ctx.grad_alloc, &x);
+    for (int chain = 0; chain < 64; chain++)
+    {
+        expected[chain] = get_gradient(&ctx.grad_alloc, &w[chain]);
+    }
+
+    ThreadPool pool;
+    thread_pool_init(&pool, 3);
+    for (int run = 0; run < 3; run++)
+    {
+        VariablesGradAllocator grad_alloc;
+        init_grad_alloc(&grad_alloc);
+        get_gradients_parallel(&grad_alloc, &pool, &out, NULL, 1);
+
+        // only the summation order differs from the sequential sweep
+        TEST_ASSERT_DOUBLE_WITHIN(SUM_ORDER_TOLERANCE * fabs(expected[64]), expected[64], get_gradient(&grad_alloc, &x));
+        for (int chain = 0; chain < 64; chain++)
+        {
+            TEST_ASSERT_DOUBLE_WITHIN(SUM_ORDER_TOLERANCE * fabs(expected[chain]), expected[chain], get_gradient(&grad_alloc, &w[chain]));
+        }
+        free_grad_buffers(&grad_alloc);
+    }
+    thread_pool_free(&pool);
+
+    bind_graph_context(NULL);
+    graph_context_free(&ctx);
+}
+
+// element-wise product of two same-shape tensors, as a tensor op defined
+// outside the library
+void tensor_test_mul_backward(Tensor *out)
+{
+    Tensor *a = out->children[0];
+    Tensor *b = out->children[1];
+    for (size_t idx = 0; idx < out->size; idx++)
+    {
+        if (a->requires_grad)
+        {
+            tensor_grad(a)[idx] += out->grad[idx] * b->data[idx];
+        }
+        if (b->requires_grad)
+        {
+            tensor_grad(b)[idx] += out->grad[idx] * a->data[idx];
+        }
+    }
+}
+
+Tensor *tensor_test_mul(Tensor *a, Tensor *b)
+{
+    Tensor *children[2] = {a, b};
+    Tensor *out = new_op_tensor(a->shape_size, a->shape, children, 2, tensor_test_mul_backward);
+    for (size_t idx = 0; idx < out->size; idx++)
+    {
+        out->data[idx] = a->data[idx] * b->data[idx];
+    }
+    return out;
+}
+
+void test_tensor(void)
+{
+    size_t shape[3] = {2, 3, 4};
+    Tensor *x = init_tensor(3, shape);
+    Tensor *w = init_tensor(3, shape);
+    Tensor *c = init_tensor(3, shape);
+    TEST_ASSERT_EQUAL_size_t(24, x->size);
+    TEST_ASSERT_EQUAL_INT(12, x->strides[0]);
+    TEST_ASSERT_EQUAL_INT(4, x->strides[1]);
+    TEST_ASSERT_EQUAL_INT(1, x->strides[2]);
+    int indices[3] = {1, 2, 3};
+    TEST_ASSERT_EQUAL_INT(23, tensor_index(x, indices));
+
+    // ranks above NN_MAX_DIMS are refused
+    size_t deep_shape[NN_MAX_DIMS + 1];
+    for (size_t i = 0; i <= NN_MAX_DIMS; i++)
+    {
+        deep_shape[i] = i < NN_MAX_DIMS + 1 - 3 ? 1 : shape[i - (NN_MAX_DIMS + 1 - 3)];
+    }
+    TEST_ASSERT_NULL(init_tensor(NN_MAX_DIMS + 1, deep_shape));
+    TEST_ASSERT_NULL(tensor_expand(x, NN_MAX_DIMS + 1, deep_shape));
+    TEST_ASSERT_NULL(tensor_reshape(x, NN_MAX_DIMS + 1, deep_shape));
+
+    x->requires_grad = true;
+    w->requires_grad = true;
+    for (size_t idx = 0; idx < x->size; idx++)
+    {
+        x->data[idx] = 0.1 * idx - 1;
+        w->data[idx] = 0.5 + idx;
+        c->data[idx] = 2;
+    }
+
+    // out = x * x * w * c: one node per op, x is used twice
+    Tensor *out = tensor_test_mul(tensor_test_mul(tensor_test_mul(x, x), w), c);
+    TEST_ASSERT_TRUE(out->requires_grad);
+    tensor_backward(out);
+    for (size_t idx = 0; idx < x->size; idx++)
+    {
+        TEST_ASSERT_EQUAL_DOUBLE(4 * x->data[idx] * w->data[idx], x->grad[idx]);
+        TEST_ASSERT_EQUAL_DOUBLE(2 * x->data[idx] * x->data[idx], w->grad[idx]);
+    }
+    TEST_ASSERT_NULL(c->grad);
+
+    // a second backward starts from zeroed grads
+    tensor_backward(out);
+    TEST_ASSERT_EQUAL_DOUBLE(4 * x->data[5] * w->data[5], x->grad[5]);
+
+    // the leaves are still referenced by us, everything else goes
+    retain_tensor(x);
+    free_tensor(out);
+    TEST_ASSERT_EQUAL_size_t(1, x->refcount);
+    release_tensor(x);
+}
+
+void test_gemm(void)
+{
+    // sizes straddling the MR/NR tiles and the MC/KC blocks
+    size_t m = 131, n = 37, k = 301;
+    nn_real *a = (nn_real *)malloc(m * k * sizeof(nn_real));
+    nn_real *b = (nn_real *)malloc(k * n * sizeof(nn_real));
+    nn_real *c = (nn_real *)malloc(m * n * sizeof(nn_real));
+    for (size_t idx = 0; idx < m * k; idx++)
+    {
+        a[idx] = sin(0.37 * idx);
+    }
+    for (size_t idx = 0; idx < k * n; idx++)
+    {
+        b[idx] = cos(0.11 * idx);
+    }
+
+    // row-major A times B read as the transpose of an n x k matrix
+    gemm(m, n, k, a, k, 1, b, 1, k, c, n, 1, false);
+    for (size_t i = 0; i < m; i++)
+    {
+        for (size_t j = 0; j < n; j++)
+        {
+            double expected = 0;
+            for (size_t p = 0; p < k; p++)
+            {
+                expected += a[i * k + p] * b[j * k + p];
+            }
+            TEST_ASSERT_DOUBLE_WITHIN(SUM_ORDER_TOLERANCE * k, expected, c[i * n + j]);
+        }
+    }
+
+    free(c);
+    free(b);
+    free(a);
+}
+
+void test_matmul(void)
+{
+    size_t a_shape[2] = {5, 7}, b_shape[2] = {7, 3};
+    Tensor *a = init_tensor(2, a_shape);
+    Tensor *b = init_tensor(2, b_shape);
+    a->requires_grad = true;
+    b->requires_grad = true;
+    for (size_t idx = 0; idx < a->size; idx++)
+    {
+        a->data[idx] = 0.25 * idx - 2;
+    }
+    for (size_t idx = 0; idx < b->size; idx++)
+    {
+        b->data[idx] = 1.5 - 0.125 * idx;
+    }
+
+    // loss = sum(C * W) for a fixed W, so dC = W
+    Tensor *c = matmul(a, b);
+    Tensor *w = init_tensor(2, c->shape);
+    for (size_t idx = 0; idx < w->size; idx++)
+    {
+        w->data[idx] = idx % 4 - 1.5;
+    }
+    Tensor *loss = tensor_test_mul(c, w);
+    tensor_backward(loss);
+
+    for (size_t i = 0; i < 5; i++)
+    {
+        for (size_t j = 0; j < 3; j++)
+        {
+            double expected = 0;
+            for (size_t p = 0; p < 7; p++)
+            {
+                expected += a->data[i * 7 + p] * b->data[p * 3 + j];
+            }
+            TEST_ASSERT_EQUAL_DOUBLE(expected, c->data[i * 3 + j]);
+        }
+        for (size_t p = 0; p < 7; p++)
+        {
+            double expected = 0;
+            for (size_t j = 0; j < 3; j++)
+            {
+                expected += w->data[i * 3 + j] * b->data[p * 3 + j];
+            }
+            TEST_ASSERT_EQUAL_DOUBLE(expected, a->grad[i * 7 + p]);
+        }
+    }
+    for (size_t p = 0; p < 7; p++)
+    {
+        for (size_t j = 0; j < 3; j++)
+        {
+            double expected = 0;
+            for (size_t i = 0; i < 5; i++)
+            {
+                expected += a->data[i * 7 + p] * w->data[i * 3 + j];
+            }
+            TEST_ASSERT_EQUAL_DOUBLE(expected, b->grad[p * 3 + j]);
+        }
+    }
+    TEST_ASSERT_NULL(matmul(a, a));
+
+    free_tensor(loss);
+}
+
+void test_tensor_broadcast(void)
+{
+    size_t a_shape[2] = {2, 3}, b_shape[1] = {3}, c_shape[2] = {2, 1};
+    Tensor *a = init_tensor(2, a_shape);
+    Tensor *b = init_tensor(1, b_shape);
+    Tensor *c = init_tensor(2, c_shape);
+    a->requires_grad = b->requires_grad = c->requires_grad = true;
+    for (size_t idx = 0; idx < 6; idx++)
+    {
+        a->data[idx] = 0.5 * idx - 1.2;
+    }
+    b->data[0] = 0.3, b->data[1] = -0.7, b->data[2] = 1.1;
+    c->data[0] = 2.0, c->data[1] = -3.0;
+
+    // trailing dims 3 and 2 do not broadcast
+    Tensor *bad = init_tensor(1, (size_t[]){2});
+    TEST_ASSERT_NULL(tensor_add(a, bad));
+
+    // a missing operand is an error, not a unary op on a
+    TEST_ASSERT_NULL(tensor_add(a, NULL));
+    TEST_ASSERT_NULL(tensor_mul(a, tensor_add(a, bad)));
+    TEST_ASSERT_NULL(tensor_sigmoid(NULL));
+    free_tensor(bad);
+
+    // out = sigmoid((a - b) * c) + relu(a)^2, shapes (2, 3), (3), (2, 1)
+    Tensor *diff = tensor_sub(a, b);
+    Tensor *out = tensor_add(tensor_sigmoid(tensor_mul(diff, c)), tensor_power(tensor_relu(a), 2));
+    TEST_ASSERT_EQUAL_size_t(2, out->shape_size);
+    TEST_ASSERT_EQUAL_size_t(2, out->shape[0]);
+    TEST_ASSERT_EQUAL_size_t(3, out->shape[1]);
+    tensor_backward(out);
+
+    double d_b[3] = {0}, d_c[2] = {0};
+    for (size_t i = 0; i < 2; i++)
+    {
+        for (size_t j = 0; j < 3; j++)
+        {
+            double x = a->data[i * 3 + j], d = x - b->data[j];
+            double sig = 1 / (1 + exp(-d * c->data[i]));
+            double relu = x > 0 ? x : 0;
+            double d_sig = sig * (1 - sig);
+            TEST_ASSERT_EQUAL_DOUBLE(sig + relu * relu, out->data[i * 3 + j]);
+            TEST_ASSERT_EQUAL_DOUBLE(d_sig * c->data[i] + 2 * relu, a->grad[i * 3 + j]);
+            d_b[j] -= d_sig * c->data[i];
+            d_c[i] += d_sig * d;
+        }
+    }
+    // broadcast operands get the gradient summed over the dims they were repeated along
+    for (size_t j = 0; j < 3; j++)
+    {
+        TEST_ASSERT_EQUAL_DOUBLE(d_b[j], b->grad[j]);
+    }
+    TEST_ASSERT_EQUAL_DOUBLE(d_c[0], c->grad[0]);
+    TEST_ASSERT_EQUAL_DOUBLE(d_c[1], c->grad[1]);
+
+    // relu'(0) follows the scalar engine, eagerly and fused
+    Variable zero;
+    init_var(&zero, 0.0, true);
+    Variable *scalar_relu = relu(&zero);
+    VariablesGradAllocator grad_alloc;
+    init_grad_alloc(&grad_alloc);
+    get_gradients(&grad_alloc, &scalar_relu, 1);
+    Tensor *z = init_tensor(1, (size_t[]){2});
+    Tensor *z_fused = init_tensor(1, (size_t[]){2});
+    z->requires_grad = z_fused->requires_grad = true;
+    Tensor *relu_sum = tensor_sum(tensor_relu(z), NULL, 0, false);
+    Tensor *fused_sum = tensor_sum(tensor_eval(expr_relu(expr_tensor(z_fused))), NULL, 0, false);
+    tensor_backward(relu_sum);
+    tensor_backward(fused_sum);
+    TEST_ASSERT_EQUAL_DOUBLE(1.0, get_gradient(&grad_alloc, &zero));
+    TEST_ASSERT_EQUAL_DOUBLE(1.0, z->grad[0]);
+    TEST_ASSERT_EQUAL_DOUBLE(1.0, z_fused->grad[1]);
+
+    free_from_variable(scalar_relu);
+    free_grad_buffers(&grad_alloc);
+    free_tensor(relu_sum);
+    free_tensor(fused_sum);
+    free_tensor(out);
+}
+
+void test_tensor_reduce(void)
+{
+    size_t shape[3] = {2, 3, 4};
+    Tensor *a = init_tensor(3, shape);
+    a->requires_grad = true;
+    for (size_t idx = 0; idx < a->size; idx++)
+    {
+        a->data[idx] = (idx * 7) % 11 - 4.5;
+    }
+
+    // sum over dims 0 and 2, mean over dim 1 with the dim kept
+    Tensor *sum = tensor_sum(a, (int[]){0, 2}, 2, false);
+    Tensor *mean = tensor_mean(a, (int[]){1}, 1, true);
+    TEST_ASSERT_EQUAL_size_t(1, sum->shape_size);
+    TEST_ASSERT_EQUAL_size_t(3, sum->shape[0]);
+    TEST_ASSERT_EQUAL_size_t(3, mean->shape_size);
+    TEST_ASSERT_EQUAL_size_t(1, mean->shape[1]);
+    for (size_t j = 0; j < 3; j++)
+    {
+        double expected = 0;
+        for (size_t i = 0; i < 2; i++)
+        {
+            for (size_t k = 0; k < 4; k++)
+            {
+                expected += a->data[i * 12 + j * 4 + k];
+            }
+        }
+        TEST_ASSERT_EQUAL_DOUBLE(expected, sum->data[j]);
+    }
+    TEST_ASSERT_EQUAL_DOUBLE((a->data[1] + a->data[5] + a->data[9]) / 3, mean->data[1]);
+
+    tensor_backward(sum);
+    TEST_ASSERT_EQUAL_DOUBLE(1.0, a->grad[17]);
+    tensor_backward(mean);
+    TEST_ASSERT_EQUAL_DOUBLE(1.0 / 3, a->grad[17]);
+
+    // max over the last dim, gradient only at the maxima
+    Tensor *max = tensor_max(a, (int[]){2}, 1, false);
+    Tensor *argmax = tensor_argmax(a, (int[]){2}, 1, false);
+    TEST_ASSERT_FALSE(argmax->requires_grad);
+    tensor_backward(max);
+    for (size_t row = 0; row < 6; row++)
+    {
+        size_t best = (size_t)argmax->data[row];
+        for (size_t k = 0; k < 4; k++)
+        {
+            TEST_ASSERT_TRUE(a->data[row * 4 + k] <= a->data[row * 4 + best]);
+            TEST_ASSERT_EQUAL_DOUBLE(k == best ? 1.0 : 0.0, a->grad[row * 4 + k]);
+        }
+        TEST_ASSERT_EQUAL_DOUBLE(a->data[row * 4 + best], max->data[row]);
+    }
+    TEST_ASSERT_NULL(tensor_sum(a, (int[]){3}, 1, false));
+
+    // groups without elements sum to 0, but have no mean or max
+    Tensor *empty = init_tensor(2, (size_t[]){3, 0});
+    empty->requires_grad = true;
+    TEST_ASSERT_NULL(tensor_mean(empty, (int[]){1}, 1, false));
+    TEST_ASSERT_NULL(tensor_max(empty, (int[]){1}, 1, false));
+    TEST_ASSERT_NULL(tensor_argmax(empty, (int[]){1}, 1, false));
+    Tensor *empty_sum = tensor_sum(empty, (int[]){1}, 1, false);
+    TEST_ASSERT_EQUAL_size_t(3, empty_sum->size);
+    TEST_ASSERT_EQUAL_DOUBLE(0.0, empty_sum->data[2]);
+    free_tensor(empty_sum);
+
+    // 2^20 tenths, pairwise summation keeps the error far below a running sum's
+    size_t n = (size_t)1 << 20;
+    Tensor *big = init_tensor(1, &n);
+    for (size_t idx = 0; idx < n; idx++)
+    {
+        big->data[idx] = 0.1;
+    }
+    Tensor *total = tensor_sum(big, NULL, 0, false);
+    TEST_ASSERT_EQUAL_size_t(0, total->shape_size);
+    TEST_ASSERT_EQUAL_DOUBLE(n * (double)(nn_real)0.1, total->data[0]);
+
+    // a goes with the last of the reductions referencing it
+    free_tensor(sum);
+    free_tensor(mean);
+    free_tensor(max);
+    free_tensor(argmax);
+    free_tensor(total);
+}
+
+void test_tensor_views(void)
+{
+    size_t shape[2] = {4, 6};
+    Tensor *a = init_tensor(2, shape);
+    a->requires_grad = true;
+    for (size_t idx = 0; idx < a->size; idx++)
+    {
+        a->data[idx] = idx;
+    }
+
+    // views share a's storage
+    Tensor *t = tensor_transpose(a, 0, 1);
+    TEST_ASSERT_TRUE(t->data == a->data);
+    TEST_ASSERT_EQUAL_size_t(6, t->shape[0]);
+    TEST_ASSERT_EQUAL_DOUBLE(a->data[2 * 6 + 5], t->data[tensor_index(t, (int[]){5, 2})]);
+    TEST_ASSERT_FALSE(tensor_is_contiguous(t));
+    TEST_ASSERT_NULL(tensor_reshape(t, 1, (size_t[]){24}));
+
+    // rows 1 and 3, columns 0, 2, 4
+    Tensor *s = tensor_slice(tensor_slice(a, 0, 1, 4, 2), 1, 0, 6, 2);
+    TEST_ASSERT_EQUAL_size_t(2, s->shape[0]);
+    TEST_ASSERT_EQUAL_size_t(3, s->shape[1]);
+    TEST_ASSERT_EQUAL_DOUBLE(3 * 6 + 4, s->data[tensor_index(s, (int[]){1, 2})]);
+
+    Tensor *r = tensor_reshape(a, 3, (size_t[]){2, 2, 6});
+    TEST_ASSERT_EQUAL_DOUBLE(a->data[17], r->data[tensor_index(r, (int[]){1, 0, 5})]);
+
+    // a column expanded over 5 rows
+    Tensor *col = tensor_slice(tensor_slice(a, 1, 1, 2, 1), 0, 0, 1, 1);
+    Tensor *e = tensor_expand(col, 2, (size_t[]){5, 1});
+    TEST_ASSERT_EQUAL_INT(0, e->strides[0]);
+    TEST_ASSERT_NULL(tensor_expand(s, 2, (size_t[]){2, 4}));
+
+    // invalid dims and steps are refused
+    TEST_ASSERT_NULL(tensor_slice(a, 1, 0, 6, 0));
+    TEST_ASSERT_NULL(tensor_slice(a, 2, 0, 1, 1));
+    TEST_ASSERT_NULL(tensor_slice(a, -1, 0, 1, 1));
+    TEST_ASSERT_NULL(tensor_transpose(a, 0, 2));
+    TEST_ASSERT_NULL(tensor_permute(a, (int[]){1, 1}));
+    TEST_ASSERT_NULL(tensor_permute(a, (int[]){0, 2}));
+
+    // loss = sum(s * s) + sum(t @ w) + sum(e), gradients land in a
+    size_t w_shape[2] = {4, 2};
+    Tensor *w = init_tensor(2, w_shape);
+    for (size_t idx = 0; idx < w->size; idx++)
+    {
+        w->data[idx] = 1;
+    }
+    Tensor *loss = tensor_add(tensor_add(tensor_sum(tensor_mul(s, s), NULL, 0, false),
+                                         tensor_sum(matmul(t, w), NULL, 0, false)),
+                              tensor_sum(e, NULL, 0, false));
+    tensor_backward(loss);
+    for (size_t i = 0; i < 4; i++)
+    {
+        for (size_t j = 0; j < 6; j++)
+        {
+            // t @ w: every element of a is used twice (w has two columns)
+            double expected = 2;
+            if (i % 2 == 1 && j % 2 == 0)
+            {
+                expected += 2 * a->data[i * 6 + j];
+            }
+            if (i == 0 && j == 1)
+            {
+                expected += 5;
+            }
+            TEST_ASSERT_EQUAL_DOUBLE(expected, a->grad[i * 6 + j]);
+        }
+    }
+
+    free_tensor(loss);
+    free_tensor(r);
+}
+
+void test_tensor_fusion(void)
+{
+    // inner dimension spans more than one fused block
+    size_t shape[2] = {2, NN_FUSE_BLOCK + 44};
+    size_t c_shape[1] = {NN_FUSE_BLOCK + 44};
+    Tensor *leaves[2][3];
+    for (int copy = 0; copy < 2; copy++)
+    {
+        leaves[copy][0] = init_tensor(2, shape);
+        leaves[copy][1] = init_tensor(2, shape);
+        leaves[copy][2] = init_tensor(1, c_shape);
+        for (int l = 0; l < 3; l++)
+        {
+            leaves[copy][l]->requires_grad = true;
+            for (size_t idx = 0; idx < leaves[copy][l]->size; idx++)
+            {
+                leaves[copy][l]->data[idx] = (nn_real)((int)((idx * 7 + l * 3) % 11) - 5) / 4;
+            }
+        }
+    }
+
+    // sigmoid(a * b + c) + a * b, with a * b shared
+    Tensor *ab = tensor_mul(leaves[0][0], leaves[0][1]);
+    retain_tensor(ab);
+    Tensor *unfused = tensor_add(tensor_sigmoid(tensor_add(ab, leaves[0][2])), ab);
+    release_tensor(ab);
+
+    TensorExpr *ab_expr = expr_mul(expr_tensor(leaves[1][0]), expr_tensor(leaves[1][1]));
+    Tensor *fused = tensor_eval(expr_add(expr_sigmoid(expr_add(ab_expr, expr_tensor(leaves[1][2]))), ab_expr));
+    TEST_ASSERT_NOT_NULL(fused);
+    TEST_ASSERT_EQUAL_INT(3, fused->n_children);
+    TEST_ASSERT_EQUAL_size_t(unfused->size, fused->size);
+    for (size_t idx = 0; idx < fused->size; idx++)
+    {
+        TEST_ASSERT_EQUAL_DOUBLE(unfused->data[idx], fused->data[idx]);
+    }
+
+    Tensor *unfused_loss = tensor_sum(unfused, NULL, 0, false);
+    Tensor *fused_loss = tensor_sum(fused, NULL, 0, false);
+    tensor_backward(unfused_loss);
+    tensor_backward(fused_loss);
+    for (int l = 0; l < 3; l++)
+    {
+        for (size_t idx = 0; idx < leaves[0][l]->size; idx++)
+        {
+            TEST_ASSERT_DOUBLE_WITHIN(SUM_ORDER_TOLERANCE, leaves[0][l]->grad[idx], leaves[1][l]->grad[idx]);
+        }
+    }
+
+    // shapes [N] and [3] do not broadcast
+    Tensor *short_tensor = init_tensor(1, (size_t[]){3});
+    TensorExpr *x = expr_tensor(leaves[1][2]);
+    TensorExpr *y = expr_tensor(short_tensor);
+    TEST_ASSERT_NULL(expr_add(x, y));
+
+    // the failure propagates up the tree instead of evaluating x * x
+    TEST_ASSERT_NULL(expr_mul(x, expr_add(x, y)));
+    TEST_ASSERT_NULL(tensor_eval(expr_sigmoid(expr_mul(x, NULL))));
+    TEST_ASSERT_NULL(expr_relu(NULL));
+    free(x);
+    free(y);
+    free_tensor(short_tensor);
+
+    free_tensor(unfused_loss);
+    free_tensor(fused_loss);
+}
+
+void test_conv2d(void)
+{
+    // N, C, H, W = 2, 3, 7, 6 and O, KH, KW = 4, 3, 2
+    size_t x_shape[4] = {2, 3, 7, 6};
+    size_t w_shape[4] = {4, 3, 3, 2};
+    size_t stride = 2, padding = 1, dilation = 2;
+    Tensor *x = init_tensor(4, x_shape);
+    Tensor *w = init_tensor(4, w_shape);
+    x->requires_grad = true;
+    w->requires_grad = true;
+    for (size_t idx = 0; idx < x->size; idx++)
+    {
+        x->data[idx] = (nn_real)((int)(idx * 5 % 13) - 6) / 8;
+    }
+    for (size_t idx = 0; idx < w->size; idx++)
+    {
+        w->data[idx] = (nn_real)((int)(idx * 3 % 7) - 3) / 4;
+    }
+
+    Tensor *y = conv2d(x, w, stride, padding, dilation);
+    TEST_ASSERT_NOT_NULL(y);
+    // (7 + 2 - 5) / 2 + 1 and (6 + 2 - 3) / 2 + 1
+    TEST_ASSERT_EQUAL_size_t(3, y->shape[2]);
+    TEST_ASSERT_EQUAL_size_t(3, y->shape[3]);
+
+    // loss = sum(y * g) so that every output position has its own gradient
+    Tensor *g = init_tensor(4, y->shape);
+    for (size_t idx = 0; idx < g->size; idx++)
+    {
+        g->data[idx] = (nn_real)((int)(idx % 5) - 2);
+    }
+    Tensor *loss = tensor_sum(tensor_mul(y, g), NULL, 0, false);
+    tensor_backward(loss);
+
+    // direct convolution and its gradients
+    double *x_grad = (double *)calloc(x->size, sizeof(double));
+    double *w_grad = (double *)calloc(w->size, sizeof(double));
+    for (size_t n = 0; n < 2; n++)
+    {
+        for (size_t o = 0; o < 4; o++)
+        {
+            for (size_t oy = 0; oy < 3; oy++)
+            {
+                for (size_t ox = 0; ox < 3; ox++)
+                {
+                    size_t y_idx = ((n * 4 + o) * 3 + oy) * 3 + ox;
+                    double expected = 0;
+                    for (size_t c = 0; c < 3; c++)
+                    {
+                        for (size_t ky = 0; ky < 3; ky++)
+                        {
+                            for (size_t kx = 0; kx < 2; kx++)
+                            {
+                                int iy = (int)(oy * stride + ky * dilation) - (int)padding;
+                                int ix = (int)(ox * stride + kx * dilation) - (int)padding;
+                                if (iy < 0 || iy >= 7 || ix < 0 || ix >= 6)
+                                {
+                                    continue;
+                                }
+                                size_t x_idx = ((n * 3 + c) * 7 + iy) * 6 + ix;
+                                size_t w_idx = ((o * 3 + c) * 3 + ky) * 2 + kx;
+                                expected += x->data[x_idx] * w->data[w_idx];
+                                x_grad[x_idx] += g->data[y_idx] * w->data[w_idx];
+                                w_grad[w_idx] += g->data[y_idx] * x->data[x_idx];
+                            }
+                        }
+                    }
+                    TEST_ASSERT_DOUBLE_WITHIN(SUM_ORDER_TOLERANCE, expected, y->data[y_idx]);
+                }
+            }
+        }
+    }
+    for (size_t idx = 0; idx < x->size; idx++)
+    {
+        TEST_ASSERT_DOUBLE_WITHIN(SUM_ORDER_TOLERANCE, x_grad[idx], x->grad[idx]);
+    }
+    for (size_t idx = 0; idx < w->size; idx++)
+    {
+        TEST_ASSERT_DOUBLE_WITHIN(SUM_ORDER_TOLERANCE, w_grad[idx], w->grad[idx]);
+    }
+
+    // a 5-tap dilated kernel does not fit in 3 rows without padding
+    Tensor *rows = tensor_slice(x, 2, 0, 3, 1);
+    TEST_ASSERT_NULL(conv2d(rows, w, 1, 0, 2));
+
+    free_tensor(rows);
+    free(x_grad);
+    free(w_grad);
+    free_tensor(loss);
+}
+
+void test_buffer_cache(void)
+{
+    GraphContext ctx;
+    graph_context_init(&ctx);
+    bind_graph_context(&ctx);
+
+    TEST_ASSERT_EQUAL_size_t(0, buffer_class(1));
+    TEST_ASSERT_EQUAL_size_t(80, buffer_class_size(buffer_class(65)));
+    TEST_ASSERT_EQUAL_size_t(128, buffer_class_size(buffer_class(128)));
+    TEST_ASSERT_EQUAL_size_t(160, buffer_class_size(buffer_class(129)));
+
+    // a step that allocates the same sizes twice only misses the first time
+    for (int step = 0; step < 2; step++)
+    {
+        Tensor *a = init_tensor(1, (size_t[]){100});
+        a->requires_grad = true;
+        for (size_t idx = 0; idx < a->size; idx++)
+        {
+            TEST_ASSERT_EQUAL_DOUBLE(0, a->data[idx]);
+            a->data[idx] = 1;
+        }
+        Tensor *loss = tensor_sum(tensor_mul(a, a), NULL, 0, false);
+        tensor_backward(loss);
+        TEST_ASSERT_EQUAL_DOUBLE(2, a->grad[99]);
+        free_tensor(loss);
+    }
+    // a, a * a, their grads and the loss and its grad
+    TEST_ASSERT_EQUAL_size_t(6, ctx.buffers.misses);
+    TEST_ASSERT_EQUAL_size_t(6, ctx.buffers.hits);
+    TEST_ASSERT_TRUE(ctx.buffers.bytes_cached >= 4 * 100 * sizeof(nn_real));
+
+    buffer_cache_trim(&ctx.buffers);
+    TEST_ASSERT_EQUAL_size_t(0, ctx.buffers.bytes_cached);
+    Tensor *b = init_tensor(1, (size_t[]){98});
+    TEST_ASSERT_EQUAL_size_t(7, ctx.buffers.misses);
+    free_tensor(b);
+
+    // matmul packs its operands in cached buffers too: a second product of
+    // the same shapes allocates nothing
+    Tensor *m = init_tensor(2, (size_t[]){5, 7});
+    retain_tensor(m);
+    Tensor *first = matmul(m, tensor_transpose(m, 0, 1));
+    free_tensor(first);
+    size_t misses = ctx.buffers.misses, hits = ctx.buffers.hits;
+    Tensor *second = matmul(m, tensor_transpose(m, 0, 1));
+    TEST_ASSERT_EQUAL_size_t(misses, ctx.buffers.misses);
+    TEST_ASSERT_EQUAL_size_t(hits + 3, ctx.buffers.hits); // the output and both packs
+    free_tensor(second);
+    release_tensor(m);
+
+    bind_graph_context(NULL);
+    graph_context_free(&ctx);
+}
+
+// Caches a buffer on the thread's default context and reports what it holds
+void *default_context_worker(void *arg)
+{
+    size_t *cached = arg;
+    Tensor *t = init_tensor(1, (size_t[]){100});
+    free_tensor(t);
+    GraphContext *ctx = graph_context();
+    cached[0] = ctx->buffers.bytes_cached;
+    cached[1] = pthread_getspecific(NN_DEFAULT_CONTEXT_KEY) == ctx;
+    return NULL;
+}
+
+void test_default_context_thread_exit(void)
+{
+    // the worker's default context is registered for release at thread exit,
+    // so its cached buffer does not outlive the thread (checked under LSan)
+    size_t cached[2] = {0, 0};
+    pthread_t thread;
+    pthread_create(&thread, NULL, default_context_worker, cached);
+    pthread_join(thread, NULL);
+    TEST_ASSERT_TRUE(cached[0] >= 100 * sizeof(nn_real));
+    TEST_ASSERT_EQUAL_size_t(1, cached[1]);
+}
+
+void test_softmax_cross_entropy(void)
+{
+    // the middle row's logits would overflow exp without log-sum-exp
+    size_t shape[2] = {3, 4};
+    double values[3][4] = {{1, 2, 3, 4}, {1000, 1001, 999, 1000}, {-2, 0.5, 0.25, -1}};
+    size_t classes[3] = {3, 0, 1};
+    Tensor *logits = init_tensor(2, shape);
+    Tensor *targets = init_tensor(1, shape);
+    logits->requires_grad = true;
+    for (size_t i = 0; i < 3; i++)
+    {
+        for (size_t j = 0; j < 4; j++)
+        {
+            logits->data[i * 4 + j] = values[i][j];
+        }
+        targets->data[i] = classes[i];
+    }
+
+    Tensor *loss = softmax_cross_entropy(logits, targets);
+    TEST_ASSERT_NOT_NULL(loss);
+    tensor_backward(loss);
+
+    double expected = 0;
+    for (size_t i = 0; i < 3; i++)
+    {
+        double max = values[i][0], sum = 0;
+        for (size_t j = 1; j < 4; j++)
+        {
+            max = fmax(max, values[i][j]);
+        }
+        for (size_t j = 0; j < 4; j++)
+        {
+            sum += exp(values[i][j] - max);
+        }
+        expected += (max + log(sum) - values[i][classes[i]]) / 3;
+        for (size_t j = 0; j < 4; j++)
+        {
+            double softmax = exp(values[i][j] - max) / sum;
+            TEST_ASSERT_DOUBLE_WITHIN(1e-6, (softmax - (j == classes[i])) / 3, logits->grad[i * 4 + j]);
+        }
+    }
+    TEST_ASSERT_DOUBLE_WITHIN(SUM_ORDER_TOLERANCE, expected, loss->data[0]);
+
+    // the same logits read through a strided view
+    Tensor *wide = init_tensor(2, (size_t[]){3, 8});
+    for (size_t idx = 0; idx < logits->size; idx++)
+    {
+        wide->data[2 * idx] = logits->data[idx];
+    }
+    Tensor *view_loss = softmax_cross_entropy(tensor_slice(wide, 1, 0, 8, 2), targets);
+    TEST_ASSERT_EQUAL_DOUBLE(loss->data[0], view_loss->data[0]);
+
+    targets->data[2] = 4;
+    TEST_ASSERT_NULL(softmax_cross_entropy(logits, targets));
 
+    free_tensor(view_loss);
+    free_tensor(loss);
+    free_tensor(targets);
 }
 
 int main(void)
@@ -182,7 +1651,32 @@ int main(void)
     RUN_TEST(test_ReLU);
     RUN_TEST(test_Power);
     RUN_TEST(test_get_gradients);
-    UNITY_END();
+    RUN_TEST(test_get_gradients_shared_subexpressions);
+    RUN_TEST(test_get_gradients_deep_graph);
+    RUN_TEST(test_get_gradients_pruned);
+    RUN_TEST(test_get_gradients_seeded);
+    RUN_TEST(test_get_gradients_lanes);
+    RUN_TEST(test_refcount);
+    RUN_TEST(test_checkpoint);
+    RUN_TEST(test_higher_order);
+    RUN_TEST(test_arena);
+    RUN_TEST(test_tape);
+    RUN_TEST(test_program);
+    RUN_TEST(test_forward_mode);
+    RUN_TEST(test_graph_context_threads);
+    RUN_TEST(test_graph_context_shared_leaves);
+    RUN_TEST(test_get_gradients_parallel);
+    RUN_TEST(test_tensor);
+    RUN_TEST(test_gemm);
+    RUN_TEST(test_matmul);
+    RUN_TEST(test_tensor_broadcast);
+    RUN_TEST(test_tensor_reduce);
+    RUN_TEST(test_tensor_views);
+    RUN_TEST(test_tensor_fusion);
+    RUN_TEST(test_conv2d);
+    RUN_TEST(test_buffer_cache);
+    RUN_TEST(test_default_context_thread_exit);
+    RUN_TEST(test_softmax_cross_entropy);
 
-    return 0;
+    return UNITY_END();
 }